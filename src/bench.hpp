@@ -0,0 +1,209 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+
+#ifdef __linux__
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <signal.h>
+	#include <sys/wait.h>
+	#include <sys/resource.h>
+#endif
+
+namespace Zilla
+{
+namespace Compiler
+{
+	struct sBenchOptions
+	{
+		uint32_t runs = 0; // 0 disables the harness
+		uint32_t jobs = 1; // Runs executed at once. 0 uses every core.
+		std::string input; // Fed to each run's stdin. Empty for no input.
+	};
+
+	struct sRunStats
+	{
+		double wall, user, sys; // Seconds
+		uint64_t maxRss;		// Bytes
+		int status;				// Exit code, or -1 if the program did not exit normally
+		std::string output;
+	};
+
+	// Runs 'command' with 'input' piped to its stdin and its stdout captured
+	inline static bool runMeasured(const std::vector<std::string>& command, const std::string& input, sRunStats* stats)
+	{
+		#ifdef __linux__
+			std::vector<char*> argv;
+			for(auto& arg : command)
+				argv.push_back(const_cast<char*>(arg.c_str()));
+			argv.push_back(nullptr);
+
+			int in[2], out[2];
+			if(pipe2(in, O_CLOEXEC))
+				return false;
+			if(pipe2(out, O_CLOEXEC))
+			{
+				close(in[0]);
+				close(in[1]);
+				return false;
+			}
+
+			const auto start = std::chrono::steady_clock::now();
+			const pid_t pid = fork();
+
+			if(pid == 0) // Only async-signal-safe calls until exec
+			{
+				dup2(in[0], 0);
+				dup2(out[1], 1);
+				execvp(argv[0], argv.data());
+				_exit(127);
+			}
+
+			close(in[0]);
+			close(out[1]);
+
+			if(pid < 0)
+			{
+				close(in[1]);
+				close(out[0]);
+				return false;
+			}
+
+			// Feeds stdin and drains stdout together, so neither pipe can fill up and stall the child
+			size_t written = 0;
+			int inFd = in[1];
+			char buffer[1 << 16];
+			stats->output.clear();
+
+			if(input.empty())
+			{
+				close(inFd);
+				inFd = -1;
+			}
+
+			while(true)
+			{
+				pollfd fds[2] = {{out[0], POLLIN, 0}, {inFd, POLLOUT, 0}};
+				if(poll(fds, inFd >= 0 ? 2 : 1, -1) < 0)
+					continue;
+
+				if(inFd >= 0 && fds[1].revents)
+				{
+					ssize_t n = write(inFd, input.data() + written, std::min<size_t>(input.size() - written, sizeof(buffer)));
+					if(n > 0)
+						written += n;
+					if(n <= 0 || written == input.size())
+					{
+						close(inFd);
+						inFd = -1;
+					}
+				}
+
+				if(fds[0].revents)
+				{
+					ssize_t n = read(out[0], buffer, sizeof(buffer));
+					if(n <= 0)
+						break;
+					stats->output.append(buffer, n);
+				}
+			}
+
+			close(out[0]);
+			if(inFd >= 0)
+				close(inFd);
+
+			int status;
+			rusage usage;
+			wait4(pid, &status, 0, &usage);
+
+			stats->wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			stats->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6;
+			stats->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+			stats->maxRss = uint64_t(usage.ru_maxrss) * 1024; // Linux reports kilobytes
+			stats->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+			return true;
+		#else
+			return false;
+		#endif
+	}
+
+	// Nearest-rank percentile of sorted values
+	inline static double percentile(const std::vector<double>& sorted, double p)
+	{
+		size_t rank = size_t(p / 100 * sorted.size() + 0.999999);
+		return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+	}
+
+	// Runs a compiled program options.runs times, spread over options.jobs workers, and prints
+	// timing and memory statistics. Returns the output of the first run.
+	inline static std::string benchmark(const char * name, const std::vector<std::string>& command, const sBenchOptions& options)
+	{
+		#ifdef __linux__
+			signal(SIGPIPE, SIG_IGN); // A program that stops reading early must not take the compiler down
+		#endif
+
+		const uint32_t jobs = std::min(options.runs, options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency()));
+		std::vector<sRunStats> runs(options.runs);
+		std::vector<bool> ok(options.runs);
+		std::atomic<uint32_t> next {0};
+		std::vector<std::thread> workers;
+
+		for(uint32_t j = 0; j < jobs; j++)
+			workers.emplace_back([&]
+			{
+				for(uint32_t i; (i = next++) < options.runs;)
+					ok[i] = runMeasured(command, options.input, &runs[i]);
+			});
+
+		for(auto& w : workers) w.join();
+
+		if(std::find(ok.begin(), ok.end(), false) != ok.end())
+		{
+			std::cout << "Benchmark " << name << ": could not run '" << command[0] << "'.\n";
+			return "";
+		}
+
+		std::vector<double> wall;
+		double user = 0, sys = 0;
+		uint64_t maxRss = 0;
+		size_t mismatches = 0, failures = 0;
+
+		for(auto& r : runs)
+		{
+			wall.push_back(r.wall * 1e3);
+			user += r.user * 1e3;
+			sys += r.sys * 1e3;
+			maxRss = std::max(maxRss, r.maxRss);
+			mismatches += r.output != runs[0].output;
+			failures += r.status != 0;
+		}
+		std::sort(wall.begin(), wall.end());
+
+		double mean = 0;
+		for(double w : wall)
+			mean += w;
+		mean /= wall.size();
+
+		std::cout << std::fixed << std::setprecision(2)
+			<< "Benchmark " << name << ": " << options.runs << " runs, " << jobs << " at a time\n"
+			<< "  wall (ms)  min " << wall.front() << "  p50 " << percentile(wall, 50) << "  p90 " << percentile(wall, 90)
+			<< "  p99 " << percentile(wall, 99) << "  max " << wall.back() << "  mean " << mean << "\n"
+			<< "  cpu (ms)   user " << user / wall.size() << "  sys " << sys / wall.size() << " (mean per run)\n"
+			<< "  max RSS    " << maxRss / 1024 << " KB\n"
+			<< "  output     " << runs[0].output.size() << " bytes, "
+			<< (mismatches ? std::to_string(mismatches) + " runs differ from the first" : std::string("identical in every run"))
+			<< (failures ? ", " + std::to_string(failures) + " runs failed" : std::string()) << "\n";
+		std::cout.unsetf(std::ios::fixed);
+
+		return runs[0].output;
+	}
+}
+}
@@ -0,0 +1,463 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstdint>
+#include <type_traits>
+
+#include "tokens.hpp"
+#include "runtime.hpp"
+#include "loopAnalysis.hpp"
+#include "modules.hpp"
+#include "profiler.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Module text as written after 'inclua', without the quotes
+	inline static std::string include_path(const sToken& t)
+	{
+		return std::string(t.view().substr(1, t.str.size() - 2));
+	}
+
+	// Text as printf would have printed it: "%%" becomes '%'
+	inline static std::string unformat_text(std::string_view text)
+	{
+		std::string out;
+		for(size_t i = 0; i < text.size(); i++)
+		{
+			out += text[i];
+			if(text[i] == '%' && i + 1 < text.size() && text[i + 1] == '%')
+				i++;
+		}
+		return out;
+	}
+
+	// Output of emit_target. Text piles up in a string and reaches the stream in large blocks, so small
+	// writes skip the stream's per-call overhead. Writers that take the stream itself go through stream().
+	struct sCodeBuffer
+	{
+		static constexpr size_t s_flushSize = 1 << 16;
+
+		sCodeBuffer(std::ostream& out) : out(out){}
+		~sCodeBuffer() { stream(); }
+
+		std::ostream& out;
+		std::string text;
+
+		sCodeBuffer& operator<<(const char * s) { text += s; return *this; }
+		sCodeBuffer& operator<<(std::string_view s) { text += s; return *this; }
+		sCodeBuffer& operator<<(char c) { text += c; return *this; }
+
+		template<typename Integer, typename = std::enable_if_t<std::is_integral_v<Integer>>>
+		sCodeBuffer& operator<<(Integer i) { text += std::to_string(i); return *this; }
+
+		void flushIfFull()
+		{
+			if(text.size() >= s_flushSize)
+				stream();
+		}
+
+		std::ostream& stream()
+		{
+			out.write(text.data(), text.size());
+			text.clear();
+			return out;
+		}
+
+		size_t offset() { return size_t(out.tellp()) + text.size(); }
+	};
+
+	// Numbers are written with ';' as the decimal separator; both targets want '.'
+	inline static void write_number(sCodeBuffer& out, std::string_view number)
+	{
+		const size_t point = number.find(';');
+		out << number;
+		if(point != std::string_view::npos)
+			out.text[out.text.size() - number.size() + point] = '.';
+	}
+
+	// Drops indentation, blank lines and whole-line comments. Only meant for the runtime's own code.
+	inline static std::string minify_lua_source(const char * code)
+	{
+		std::string out;
+		for(const char * line = code; *line;)
+		{
+			while(*line == '\t' || *line == ' ')
+				line++;
+
+			const char * end = line;
+			while(*end && *end != '\n')
+				end++;
+
+			if(end != line && !(line[0] == '-' && line[1] == '-'))
+				out.append(line, end).push_back('\n');
+			line = *end ? end + 1 : end;
+		}
+		return out;
+	}
+
+	// Target policies. emit_target walks the tokens once and asks the policy for the text of each
+	// construct; every call is static, so the walk is specialized per target at compile time.
+	struct sCTarget
+	{
+		static constexpr bool lua = false;
+		static constexpr const char * moduleBegin = "{\n"; // Modules are blocks, so their variables stay local
+		static constexpr const char * moduleEnd = "}\n";
+		static constexpr const char * assign = " = ";
+		static constexpr const char * statementEnd = ";\n";
+		static constexpr const char * loopEnd = "}\n"; // Closes the scope of strength-reduced temporaries
+
+		static void prologue(sCodeBuffer& out, bool lineFlush, const sProfile * profile)
+		{
+			out << "#define ZC_LINE_FLUSH " << (lineFlush ? "1" : "0") << "\n";
+			if(profile)
+				write_profile_table(out.stream(), *profile, false);
+			out << s_cRuntime << "\nint main()\n{\n";
+		}
+
+		static void epilogue(sCodeBuffer& out, const sProfile * profile)
+		{
+			if(profile)
+				out << "\nzc_prof_write();";
+			out << "\nzc_flush();\nreturn 0;\n}";
+		}
+
+		static void declare(sCodeBuffer& out, token_it first, token_it last, bool)
+		{
+			out << "int ";
+			for(; first != last; first++)
+				out << first->str;
+			out << statementEnd;
+		}
+
+		static void print(sCodeBuffer& out, const sToken& value)
+		{
+			switch(value.token)
+			{
+				case TK_TEXT:
+					out << "zc_write_str(" << unformat_text(value.str); break;
+				case TK_FLOAT:
+				case TK_DOUBLE:
+					out << "zc_write_double(" << value.str; break;
+				default:
+					out << "zc_write_int(" << value.str; break;
+			}
+			out << ")" << statementEnd;
+		}
+
+		static void read(sCodeBuffer& out, const sToken& var)
+		{
+			out << "zc_read_int(&" << var.str << ")" << statementEnd;
+		}
+
+		static void op(sCodeBuffer& out, const sToken& t)
+		{
+			switch(t.token)
+			{
+				case TK_OP_AND:
+					out << " && "; break;
+				case TK_OP_OR:
+					out << " || "; break;
+				default:
+					out << " " << t.str << " "; break;
+			}
+		}
+
+		static void keyword(sCodeBuffer& out, const sToken& t)
+		{
+			out << t.str;
+		}
+
+		static void scope_begin(sCodeBuffer& out, enToken)
+		{
+			out << "\n{\n\t";
+		}
+
+		// Closing a do loop also writes the 'while' of its tail
+		static void scope_end(sCodeBuffer& out, enToken construct, bool)
+		{
+			out << (construct == TK_DO ? "}\nwhile" : "}\n");
+		}
+	};
+
+	struct sLuaTarget
+	{
+		static constexpr bool lua = true;
+		static constexpr const char * moduleBegin = "do\n";
+		static constexpr const char * moduleEnd = "end\n";
+		static constexpr const char * assign = " = ";
+		static constexpr const char * statementEnd = "\n";
+		static constexpr const char * loopEnd = "end\n";
+
+		static void prologue(sCodeBuffer& out, bool lineFlush, const sProfile * profile)
+		{
+			out << "local zc_line_flush = " << (lineFlush ? "true" : "false") << "\n" << s_luaRuntime;
+			if(profile)
+			{
+				write_profile_table(out.stream(), *profile, true);
+				out << s_luaProfiler;
+			}
+		}
+
+		static void epilogue(sCodeBuffer& out, const sProfile * profile)
+		{
+			if(profile)
+				out << "zc_prof_write()\n";
+			out << "zc_flush()\n";
+		}
+
+		// Program variables are globals, module variables are locals of the module's block
+		static void declare(sCodeBuffer& out, token_it first, token_it last, bool module)
+		{
+			if(!module)
+				return;
+
+			out << "local ";
+			for(; first != last; first++)
+				out << first->str << (first->token == TK_COMMA ? " " : "");
+			out << "\n";
+		}
+
+		static void print(sCodeBuffer& out, const sToken& value)
+		{
+			out << (value.token == TK_TEXT ? "zc_print_text(" : "zc_print(") << value.str << ")\n";
+		}
+
+		static void read(sCodeBuffer& out, const sToken& var)
+		{
+			out << var.str << " = zc_read()\n";
+		}
+
+		static void op(sCodeBuffer& out, const sToken& t)
+		{
+			switch(t.token)
+			{
+				case TK_OP_AND:
+					out << " and "; break;
+				case TK_OP_OR:
+					out << " or "; break;
+				default:
+					out << " " << (t.str == "!=" ? "~=" : t.str.c_str()) << " "; break;
+			}
+		}
+
+		static void keyword(sCodeBuffer& out, const sToken& t)
+		{
+			switch(t.token)
+			{
+				case TK_ELSE:
+					out << "else\n\t"; break;
+				case TK_WHILE:
+					out << "while "; break;
+				case TK_DO:
+					out << "repeat\n\t"; break;
+				default:
+					out << t.str; break;
+			}
+		}
+
+		static void scope_begin(sCodeBuffer& out, enToken construct)
+		{
+			if(construct == TK_IF)
+				out << "\nthen\n\t";
+			else if(construct == TK_WHILE)
+				out << "\ndo\n\t";
+		}
+
+		static void scope_end(sCodeBuffer& out, enToken construct, bool elseFollows)
+		{
+			if(construct == TK_DO)
+				out << "until not "; // Lua stops when the condition holds, .isi loops while it holds
+			else if(construct != TK_IF || !elseFollows)
+				out << "end\n";
+		}
+	};
+
+	// Lua without layout: no indentation, no spaces around symbols, a minified runtime.
+	// Loop rewrites and profiler probes keep their usual text.
+	struct sMinLuaTarget : sLuaTarget
+	{
+		static constexpr const char * assign = "=";
+
+		static void prologue(sCodeBuffer& out, bool lineFlush, const sProfile * profile)
+		{
+			static const std::string runtime = minify_lua_source(s_luaRuntime), profiler = minify_lua_source(s_luaProfiler);
+
+			out << "local zc_line_flush=" << (lineFlush ? "true" : "false") << "\n" << runtime;
+			if(profile)
+			{
+				write_profile_table(out.stream(), *profile, true);
+				out << profiler;
+			}
+		}
+
+		static void declare(sCodeBuffer& out, token_it first, token_it last, bool module)
+		{
+			if(!module)
+				return;
+
+			out << "local ";
+			for(; first != last; first++)
+				out << first->str;
+			out << "\n";
+		}
+
+		static void read(sCodeBuffer& out, const sToken& var)
+		{
+			out << var.str << "=zc_read()\n";
+		}
+
+		static void op(sCodeBuffer& out, const sToken& t)
+		{
+			switch(t.token)
+			{
+				case TK_OP_AND:
+					out << " and "; break;
+				case TK_OP_OR:
+					out << " or "; break;
+				default:
+					out << (t.str == "!=" ? "~=" : t.str.c_str()); break;
+			}
+		}
+
+		static void keyword(sCodeBuffer& out, const sToken& t)
+		{
+			switch(t.token)
+			{
+				case TK_ELSE:
+					out << "else "; break;
+				case TK_DO:
+					out << "repeat "; break;
+				default:
+					out << t.str; break;
+			}
+		}
+
+		static void scope_begin(sCodeBuffer& out, enToken construct)
+		{
+			if(construct == TK_IF)
+				out << "then ";
+			else if(construct == TK_WHILE)
+				out << "do ";
+		}
+
+		static void scope_end(sCodeBuffer& out, enToken construct, bool elseFollows)
+		{
+			if(construct == TK_DO)
+				out << "until not";
+			else if(construct != TK_IF || !elseFollows)
+				out << "end\n";
+		}
+	};
+
+	// Writes the code of [begin, end) for 'Target'. Nesting is tracked on a heap stack, as in the parser.
+	template<typename Target>
+	inline static void emit_target(token_it begin, token_it end, std::ostream& f_out, bool lineFlush, const sLoopPlan * plan,
+		const sProfile * profile, std::vector<sIncludeSite>* includes)
+	{
+		sCodeBuffer out(f_out);
+		std::vector<enToken> scopes; // Construct of each open '{', innermost last
+		enToken construct = TK_ERROR; // Last if, else, while or do keyword
+		bool module = false;
+
+		for(auto it = begin; it != end; it++)
+		{
+			const size_t i = it - begin;
+			if(profile && profile->siteOf[i] >= 0)
+				write_probe(out, profile->siteOf[i], *profile, Target::lua);
+
+			if(plan && write_planned(it, begin, *plan, out, Target::lua))
+				continue;
+
+			switch(it->token)
+			{
+			case TK_INIT:
+				Target::prologue(out, lineFlush, profile);
+				break;
+			case TK_END:
+				Target::epilogue(out, profile);
+				it++;
+				break;
+			case TK_MODULE:
+				module = true;
+				out << Target::moduleBegin;
+				break;
+			case TK_MODULE_END:
+				out << Target::moduleEnd;
+				it++;
+				break;
+			case TK_INCLUDE: // Spliced in when the program is linked
+				includes->push_back({out.offset(), include_path(*(it += 1))});
+				it++;
+				break;
+			case TK_DECLARE: // declare id (',' id)* .
+			{
+				const token_it first = it + 1;
+				while((++it)->token != TK_COMMAND_END);
+				Target::declare(out, first, it, module);
+				break;
+			}
+			case TK_PRINT: // escreva ( value ) .
+				Target::print(out, *(it += 2));
+				it += 2;
+				break;
+			case TK_READ: // leia ( id ) .
+				Target::read(out, *(it += 2));
+				it += 2;
+				break;
+			case TK_COMMAND_END:
+				out << Target::statementEnd;
+				break;
+			case TK_OP_ASSIGN:
+				out << Target::assign;
+				break;
+			case TK_OP_ADDSUB:
+			case TK_OP_MULTDIV:
+			case TK_OP_REL:
+			case TK_OP_AND:
+			case TK_OP_OR:
+				Target::op(out, *it);
+				break;
+			case TK_IF:
+			case TK_ELSE:
+			case TK_WHILE:
+			case TK_DO:
+				construct = it->token;
+				Target::keyword(out, *it);
+				break;
+			case TK_SCOPE_BEGIN:
+				scopes.push_back(construct);
+				Target::scope_begin(out, construct);
+				break;
+			case TK_SCOPE_END:
+				construct = scopes.back();
+				scopes.pop_back();
+				Target::scope_end(out, construct, (it + 1)->token == TK_ELSE);
+				if(construct == TK_DO) // } while ( Logicexpr ) . The policy wrote the 'while'.
+					it++;
+				break;
+			case TK_INT:
+			case TK_FLOAT:
+			case TK_DOUBLE:
+				write_number(out, it->str);
+				break;
+			case TK_PARENTH_BEGIN:
+			case TK_PARENTH_END:
+			case TK_COMMA:
+			case TK_ID:
+				out << it->str;
+				break;
+			default:
+				break;
+			}
+
+			if(plan && plan->loopEnds[i])
+				out << Target::loopEnd;
+
+			out.flushIfFull();
+		}
+	}
+}
+}
@@ -0,0 +1,386 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "tokens.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Fixed-size dense bitset, one bit per declared variable
+	struct sBitset
+	{
+		sBitset(size_t bits = 0, bool value = false)
+			: words((bits + 63) / 64, value ? ~uint64_t(0) : 0){}
+
+		std::vector<uint64_t> words;
+
+		void set(uint32_t i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+		bool test(uint32_t i) const { return words[i / 64] >> (i % 64) & 1; }
+
+		// All three return whether any bit changed
+		bool assign(const sBitset& o)
+		{
+			bool changed = words != o.words;
+			words = o.words;
+			return changed;
+		}
+
+		bool unite(const sBitset& o)
+		{
+			uint64_t changed = 0;
+			for(size_t i = 0; i < words.size(); i++)
+			{
+				uint64_t w = words[i] | o.words[i];
+				changed |= w ^ words[i];
+				words[i] = w;
+			}
+			return changed;
+		}
+
+		bool intersect(const sBitset& o)
+		{
+			uint64_t changed = 0;
+			for(size_t i = 0; i < words.size(); i++)
+			{
+				uint64_t w = words[i] & o.words[i];
+				changed |= w ^ words[i];
+				words[i] = w;
+			}
+			return changed;
+		}
+
+		// this = use | (out & ~def)
+		void transfer(const sBitset& use, const sBitset& out, const sBitset& def)
+		{
+			for(size_t i = 0; i < words.size(); i++)
+				words[i] = use.words[i] | (out.words[i] & ~def.words[i]);
+		}
+	};
+
+	struct sUse
+	{
+		uint32_t var;
+		size_t token; // Index of the identifier in the token vector
+	};
+
+	// Assignment, read, print or branch condition
+	struct sStatement
+	{
+		size_t token; // Index of the statement's first token
+		int32_t def;  // Variable written, or -1
+		std::vector<sUse> uses;
+	};
+
+	struct sBlock
+	{
+		std::vector<sStatement> statements;
+		std::vector<uint32_t> succs, preds;
+
+		sBitset use, def;			 // Upward-exposed uses and definitions
+		sBitset assignedIn, assignedOut; // Definitely assigned variables
+		sBitset liveIn, liveOut;
+	};
+
+	// Control-flow graph of a program and the facts solved over it
+	struct sFlowGraph
+	{
+		std::vector<std::string> variables;
+		std::map<std::string, uint32_t, std::less<>> variableIds;
+		std::vector<sBlock> blocks;
+
+		// Block reached after an if/else, while or do construct, keyed by the token index of its keyword
+		std::map<size_t, uint32_t> constructExits;
+
+		bool isLiveAfter(size_t constructToken, uint32_t var) const
+		{
+			return blocks[constructExits.at(constructToken)].liveIn.test(var);
+		}
+	};
+
+	struct sFlowFrame
+	{
+		enToken kind;	 // TK_IF, TK_ELSE, TK_WHILE or TK_DO
+		size_t token;	 // Keyword that opened the construct
+		uint32_t head;	 // Condition block (if, while) or first body block (do)
+		uint32_t thenExit; // Last block of the then branch (else)
+	};
+
+	inline static uint32_t newBlock(sFlowGraph& g)
+	{
+		g.blocks.emplace_back();
+		return g.blocks.size() - 1;
+	}
+
+	inline static void addEdge(sFlowGraph& g, uint32_t from, uint32_t to)
+	{
+		g.blocks[from].succs.push_back(to);
+		g.blocks[to].preds.push_back(from);
+	}
+
+	inline static uint32_t variableId(sFlowGraph& g, const sToken& t)
+	{
+		auto find = g.variableIds.find(t.view());
+		if(find == g.variableIds.end())
+			throw semantic_exception(t, "Undeclared identifier!");
+		return find->second;
+	}
+
+	// Collects identifiers read from 'i' up to the first 'stop' token
+	inline static void collectUses(sFlowGraph& g, const token_vector& tokens, size_t& i, enToken stop, std::vector<sUse>* uses)
+	{
+		for(; tokens[i].token != stop; i++)
+			if(tokens[i].token == TK_ID)
+				uses->push_back({variableId(g, tokens[i]), i});
+	}
+
+	// Builds the CFG of an already parsed program. Nesting is tracked on an explicit stack.
+	inline static void buildFlowGraph(const token_vector& tokens, sFlowGraph* g)
+	{
+		std::vector<sFlowFrame> frames;
+		uint32_t cur = newBlock(*g);
+
+		for(size_t i = 0; i < tokens.size() && tokens[i].token != TK_END; i++)
+		{
+			const sToken& t = tokens[i];
+			switch(t.token)
+			{
+				case TK_DECLARE:
+					while(tokens[++i].token != TK_COMMAND_END)
+						if(tokens[i].token == TK_ID && !g->variableIds.count(tokens[i].view()))
+						{
+							g->variables.emplace_back(tokens[i].view());
+							g->variableIds.emplace(g->variables.back(), g->variables.size() - 1);
+						}
+					break;
+				case TK_ID: // id := Expr .
+				{
+					sStatement s{i, int32_t(variableId(*g, t)), {}};
+					collectUses(*g, tokens, i += 2, TK_COMMAND_END, &s.uses);
+					g->blocks[cur].statements.push_back(std::move(s));
+					break;
+				}
+				case TK_READ: // leia ( id ) .
+					g->blocks[cur].statements.push_back({i, int32_t(variableId(*g, tokens[i + 2])), {}});
+					i += 4;
+					break;
+				case TK_PRINT: // escreva ( id | text ) .
+				{
+					sStatement s{i, -1, {}};
+					if(tokens[i + 2].token == TK_ID)
+						s.uses.push_back({variableId(*g, tokens[i + 2]), i + 2});
+					g->blocks[cur].statements.push_back(std::move(s));
+					i += 4;
+					break;
+				}
+				case TK_IF: // if ( Logicexpr ) {
+				{
+					const size_t start = i;
+					sStatement s{start, -1, {}};
+					collectUses(*g, tokens, i, TK_SCOPE_BEGIN, &s.uses);
+					g->blocks[cur].statements.push_back(std::move(s));
+
+					frames.push_back({TK_IF, start, cur, 0});
+					uint32_t then = newBlock(*g);
+					addEdge(*g, frames.back().head, then);
+					cur = then;
+					break;
+				}
+				case TK_WHILE: // while ( Logicexpr ) {
+				{
+					uint32_t head = newBlock(*g);
+					addEdge(*g, cur, head);
+
+					const size_t start = i;
+					sStatement s{start, -1, {}};
+					collectUses(*g, tokens, i, TK_SCOPE_BEGIN, &s.uses);
+					g->blocks[head].statements.push_back(std::move(s));
+
+					frames.push_back({TK_WHILE, start, head, 0});
+					cur = newBlock(*g);
+					addEdge(*g, head, cur);
+					break;
+				}
+				case TK_DO: // do {
+				{
+					uint32_t body = newBlock(*g);
+					addEdge(*g, cur, body);
+					frames.push_back({TK_DO, i, body, 0});
+					cur = body;
+					++i;
+					break;
+				}
+				case TK_SCOPE_END:
+				{
+					sFlowFrame f = frames.back();
+					frames.pop_back();
+
+					switch(f.kind)
+					{
+						case TK_IF:
+							if(tokens[i + 1].token == TK_ELSE) // } else {
+							{
+								frames.push_back({TK_ELSE, f.token, f.head, cur});
+								cur = newBlock(*g);
+								addEdge(*g, f.head, cur);
+								i += 2;
+							}
+							else
+							{
+								uint32_t join = newBlock(*g);
+								addEdge(*g, cur, join);
+								addEdge(*g, f.head, join);
+								g->constructExits[f.token] = cur = join;
+							}
+							break;
+						case TK_ELSE:
+						{
+							uint32_t join = newBlock(*g);
+							addEdge(*g, f.thenExit, join);
+							addEdge(*g, cur, join);
+							g->constructExits[f.token] = cur = join;
+							break;
+						}
+						case TK_WHILE:
+						{
+							addEdge(*g, cur, f.head);
+							uint32_t exit = newBlock(*g);
+							addEdge(*g, f.head, exit);
+							g->constructExits[f.token] = cur = exit;
+							break;
+						}
+						case TK_DO: // } while ( Logicexpr ) .
+						{
+							uint32_t cond = newBlock(*g);
+							addEdge(*g, cur, cond);
+
+							sStatement s{++i, -1, {}};
+							collectUses(*g, tokens, i, TK_COMMAND_END, &s.uses);
+							g->blocks[cond].statements.push_back(std::move(s));
+
+							addEdge(*g, cond, f.head);
+							uint32_t exit = newBlock(*g);
+							addEdge(*g, cond, exit);
+							g->constructExits[f.token] = cur = exit;
+							break;
+						}
+						default:
+							break;
+					}
+					break;
+				}
+				default:
+					break;
+			}
+		}
+	}
+
+	// Generic worklist solver. 'update' recomputes one block and returns whether its output changed;
+	// 'dependents' lists the blocks to revisit when it did.
+	template<typename Update, typename Dependents>
+	inline static void solveDataflow(size_t blocks, bool forward, Update update, Dependents dependents)
+	{
+		std::deque<uint32_t> worklist;
+		std::vector<bool> queued(blocks, true);
+
+		for(size_t i = 0; i < blocks; i++)
+			worklist.push_back(forward ? i : blocks - 1 - i);
+
+		while(!worklist.empty())
+		{
+			uint32_t b = worklist.front();
+			worklist.pop_front();
+			queued[b] = false;
+
+			if(!update(b))
+				continue;
+
+			for(uint32_t d : dependents(b))
+				if(!queued[d])
+				{
+					queued[d] = true;
+					worklist.push_back(d);
+				}
+		}
+	}
+
+	// Upward-exposed uses and definitions of every block, with the solved facts at their starting values
+	inline static void initFlowFacts(sFlowGraph& g)
+	{
+		const size_t vars = g.variables.size();
+
+		for(auto& b : g.blocks)
+		{
+			b.use = b.def = sBitset(vars);
+			for(auto& s : b.statements)
+			{
+				for(auto& u : s.uses)
+					if(!b.def.test(u.var))
+						b.use.set(u.var);
+
+				if(s.def >= 0)
+					b.def.set(s.def);
+			}
+
+			b.assignedIn = sBitset(vars);
+			b.assignedOut = sBitset(vars, true);
+			b.liveIn = b.liveOut = sBitset(vars);
+		}
+	}
+
+	// The two solves below write disjoint facts, so they may run on separate threads once initFlowFacts is done
+
+	// Definite assignment: forward, must (intersection over predecessors)
+	inline static void solveAssignment(sFlowGraph& g)
+	{
+		// Reused by every update, so visiting a block allocates nothing
+		const sBitset all(g.variables.size(), true);
+		sBitset scratch(g.variables.size());
+
+		solveDataflow(g.blocks.size(), true, [&](uint32_t i)
+		{
+			sBlock& b = g.blocks[i];
+			if(!b.preds.empty())
+			{
+				b.assignedIn.words = all.words;
+				for(uint32_t p : b.preds)
+					b.assignedIn.intersect(g.blocks[p].assignedOut);
+			}
+
+			scratch.words = b.assignedIn.words;
+			scratch.unite(b.def);
+			return b.assignedOut.assign(scratch);
+		},
+		[&](uint32_t i) -> const std::vector<uint32_t>& { return g.blocks[i].succs; });
+	}
+
+	// Liveness: backward, may (union over successors)
+	inline static void solveLiveness(sFlowGraph& g)
+	{
+		sBitset scratch(g.variables.size());
+
+		solveDataflow(g.blocks.size(), false, [&](uint32_t i)
+		{
+			sBlock& b = g.blocks[i];
+			for(uint32_t s : b.succs)
+				b.liveOut.unite(g.blocks[s].liveIn);
+
+			scratch.transfer(b.use, b.liveOut, b.def);
+			return b.liveIn.assign(scratch);
+		},
+		[&](uint32_t i) -> const std::vector<uint32_t>& { return g.blocks[i].preds; });
+	}
+
+	inline static void solveFlowGraph(sFlowGraph& g)
+	{
+		initFlowFacts(g);
+		solveAssignment(g);
+		solveLiveness(g);
+	}
+}
+}
@@ -0,0 +1,27 @@
+#include "libzcompiler.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	sCompileResult compileBuffer(const std::string& source, const sCompileOptions& options)
+	{
+		sCompileResult result(options.resource);
+		sNoPhaseReport report;
+
+		try
+		{
+			compileToMemory(source, options.flags, OUT &result, report, options.maxDepth);
+		}
+		catch(compiler_exception& e)
+		{
+			result.diagnostics.push_back(e.diagnostic());
+			result.c.clear();
+			result.lua.clear();
+			result.luaChunk.clear();
+		}
+
+		return result;
+	}
+}
+}
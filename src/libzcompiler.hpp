@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "zCompiler.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Re-entrant entry point of libzcompiler. Compiles a source buffer entirely in memory:
+	// generated code, token list and diagnostics are returned in the result, nothing is printed
+	// or written to disk. Safe to call from many threads, each with its own options.
+	// Modules included by the source are not read: their sites are listed in cIncludes/luaIncludes.
+	sCompileResult compileBuffer(const std::string& source, const sCompileOptions& options = {});
+}
+}
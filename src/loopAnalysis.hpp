@@ -0,0 +1,418 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+
+#include "tokens.hpp"
+#include "flowAnalysis.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Basic induction variable of a loop: only ever changed by 'var := var (+|-) int' in the body
+	struct sInduction
+	{
+		std::string var;
+		int64_t step;	// Net change per iteration
+		bool live;		// Whether the value is read after the loop
+	};
+
+	// Counting loop replaced by its closed form: the trip count is computed once and every
+	// induction variable advances by count * step
+	struct sClosedLoop
+	{
+		size_t end;			   // Last token of the loop
+		bool isDo;			   // do-while: the body runs once before the first test
+		std::string var;	   // Induction variable tested by the condition
+		std::string op;		   // <, <=, > or >= with 'var' on the left
+		std::string bound;	   // Loop-invariant identifier or int literal
+		int64_t step;		   // Net step of 'var'
+		std::vector<sInduction> inductions;
+	};
+
+	// 'target := var * factor' inside a loop, rewritten to add a precomputed stride each iteration
+	struct sReducedProduct
+	{
+		size_t end;			// The statement's '.'
+		uint32_t temp;		// Index of the zc_sr temporary
+		std::string target;
+		int64_t stride;		// Added to the temporary after each use
+	};
+
+	struct sReducedInit
+	{
+		uint32_t temp;
+		std::string var;
+		int64_t offset;	// Steps of 'var' before the product statement in the body
+		int64_t factor;
+	};
+
+	// Loop that keeps its shape but gets strength-reduced products
+	struct sReducedLoop
+	{
+		size_t end;
+		std::vector<sReducedInit> inits;
+	};
+
+	// Loop rewrites, keyed by token index of the loop keyword (closed, reduced) or statement (products)
+	struct sLoopPlan
+	{
+		std::map<size_t, sClosedLoop> closed;
+		std::map<size_t, sReducedLoop> reduced;
+		std::map<size_t, sReducedProduct> products;
+		std::vector<bool> loopEnds; // Tokens closing a reduced loop
+	};
+
+	// Accepts decimal and hexadecimal literals. "012" is octal to C but decimal to Lua, so it is refused.
+	inline static bool int_literal(const sToken& t, int64_t* value)
+	{
+		if(t.token != TK_INT || (t.str.size() > 1 && t.str[0] == '0' && t.str[1] != 'x'))
+			return false;
+
+		try
+		{
+			size_t used;
+			*value = std::stoll(std::string(t.view()), &used, 0);
+			return used == t.str.size();
+		}
+		catch(std::exception&)
+		{
+			return false;
+		}
+	}
+
+	// id := id (+|-) int .
+	inline static bool match_step(const token_vector& tk, size_t i, int64_t* step)
+	{
+		if(i + 5 >= tk.size() || tk[i].token != TK_ID || tk[i + 2].token != TK_ID || tk[i + 2].str != tk[i].str
+			|| tk[i + 3].token != TK_OP_ADDSUB || tk[i + 5].token != TK_COMMAND_END)
+			return false;
+
+		if(!int_literal(tk[i + 4], step))
+			return false;
+
+		if(tk[i + 3].str == "-")
+			*step = -*step;
+		return true;
+	}
+
+	// id := id * int .  or  id := int * id .
+	inline static bool match_product(const token_vector& tk, size_t i, std::string* var, int64_t* factor)
+	{
+		if(i + 5 >= tk.size() || tk[i].token != TK_ID || tk[i + 3].token != TK_OP_MULTDIV || tk[i + 3].str != "*"
+			|| tk[i + 5].token != TK_COMMAND_END)
+			return false;
+
+		size_t v = tk[i + 2].token == TK_ID ? i + 2 : i + 4;
+		size_t f = v == i + 2 ? i + 4 : i + 2;
+
+		if(tk[v].token != TK_ID || tk[v].str == tk[i].str || !int_literal(tk[f], factor))
+			return false;
+
+		*var = tk[v].str;
+		return true;
+	}
+
+	struct sBodyStatement
+	{
+		size_t begin, end;
+		std::string target; // Assigned variable, if any
+		bool isStep;
+		int64_t step;
+	};
+
+	// Splits a loop body into statements. Fails if it holds nested constructs.
+	inline static bool straight_line_body(const token_vector& tk, size_t begin, size_t end, std::vector<sBodyStatement>* body)
+	{
+		for(size_t i = begin; i < end; i++)
+		{
+			sBodyStatement s{i, i, "", false, 0};
+
+			switch(tk[i].token)
+			{
+				case TK_ID:
+					s.target = tk[i].str;
+					s.isStep = match_step(tk, i, &s.step);
+					break;
+				case TK_READ:
+					s.target = tk[i + 2].str;
+					break;
+				case TK_PRINT:
+					break;
+				default:
+					return false;
+			}
+
+			while(tk[i].token != TK_COMMAND_END)
+				i++;
+			s.end = i;
+			body->push_back(s);
+		}
+		return true;
+	}
+
+	// Trip-count test 'var op bound', where 'var' is one of the loop's induction variables.
+	// Conditions written as 'bound op var' are mirrored.
+	inline static bool match_condition(const token_vector& tk, size_t begin, size_t end, const std::map<std::string, int64_t, std::less<>>& steps,
+		std::string* var, std::string* op, std::string* bound)
+	{
+		if(end - begin != 3 || tk[begin + 1].token != TK_OP_REL)
+			return false;
+
+		static const std::map<std::string, std::string, std::less<>> mirrored = {{"<", ">"}, {">", "<"}, {"<=", ">="}, {">=", "<="}};
+		auto find = mirrored.find(tk[begin + 1].view());
+		if(find == mirrored.end())
+			return false;
+
+		const sToken& l = tk[begin], &r = tk[end - 1];
+		const auto operand = [&](const sToken& t){ return t.token == TK_INT || (t.token == TK_ID && !steps.count(t.view())); };
+
+		if(l.token == TK_ID && steps.count(l.view()) && operand(r))
+		{
+			*var = l.str; *op = find->first; *bound = r.str;
+			return true;
+		}
+
+		if(r.token == TK_ID && steps.count(r.view()) && operand(l))
+		{
+			*var = r.str; *op = find->second; *bound = l.str;
+			return true;
+		}
+
+		return false;
+	}
+
+	inline static void plan_loop(const token_vector& tk, size_t keyword, size_t condBegin, size_t condEnd,
+		size_t bodyBegin, size_t bodyEnd, size_t end, bool isDo, const sFlowGraph* flow, sLoopPlan* plan)
+	{
+		std::vector<sBodyStatement> body;
+		if(!straight_line_body(tk, bodyBegin, bodyEnd, &body) || body.empty())
+			return;
+
+		// Net steps of the basic induction variables. Any other write disqualifies a variable.
+		std::map<std::string, int64_t, std::less<>> steps;
+		std::map<std::string, bool> disqualified;
+		bool pureCounter = true;
+
+		for(auto& s : body)
+		{
+			if(s.isStep)
+				steps[s.target] += s.step;
+			else
+			{
+				pureCounter = false;
+				if(!s.target.empty())
+					disqualified[s.target] = true;
+			}
+		}
+
+		for(auto& d : disqualified)
+			steps.erase(d.first);
+
+		std::string var, op, bound;
+		if(pureCounter && match_condition(tk, condBegin, condEnd, steps, &var, &op, &bound))
+		{
+			const int64_t step = steps[var];
+			const bool descending = op[0] == '>';
+
+			if(step != 0 && (step < 0) == descending) // Guaranteed to terminate
+			{
+				sClosedLoop c{end, isDo, var, op, bound, step, {}};
+				for(auto& s : steps)
+				{
+					auto id = flow ? flow->variableIds.find(s.first) : decltype(flow->variableIds)::const_iterator();
+					bool live = !flow || id == flow->variableIds.end() || flow->isLiveAfter(keyword, id->second);
+					c.inductions.push_back({s.first, s.second, live});
+				}
+
+				plan->closed.emplace(keyword, std::move(c));
+				return;
+			}
+		}
+
+		// Strength reduction of products of a basic induction variable
+		sReducedLoop reduced{end, {}};
+		std::map<std::string, int64_t> offsets;
+		std::map<std::string, int> writes;
+
+		for(auto& s : body)
+			writes[s.target]++;
+
+		for(auto& s : body)
+		{
+			std::string iv;
+			int64_t factor;
+
+			if(s.isStep)
+				offsets[s.target] += s.step;
+			else if(writes[s.target] == 1 && !steps.count(s.target) && match_product(tk, s.begin, &iv, &factor) && steps.count(iv))
+			{
+				uint32_t temp = plan->products.size();
+				reduced.inits.push_back({temp, iv, offsets[iv], factor});
+				plan->products.emplace(s.begin, sReducedProduct{s.end, temp, s.target, steps[iv] * factor});
+			}
+		}
+
+		if(!reduced.inits.empty())
+		{
+			plan->loopEnds[end] = true;
+			plan->reduced.emplace(keyword, std::move(reduced));
+		}
+	}
+
+	// Finds induction variables and trip counts of while/do loops. 'flow' supplies liveness; without it
+	// every induction variable is kept.
+	inline static sLoopPlan analyzeLoops(const token_vector& tk, const sFlowGraph* flow)
+	{
+		sLoopPlan plan;
+		plan.loopEnds.resize(tk.size(), false);
+
+		// Matching braces, found with one stack pass
+		std::vector<size_t> match(tk.size(), 0), open;
+		for(size_t i = 0; i < tk.size(); i++)
+			if(tk[i].token == TK_SCOPE_BEGIN)
+				open.push_back(i);
+			else if(tk[i].token == TK_SCOPE_END && !open.empty())
+			{
+				match[open.back()] = i;
+				open.pop_back();
+			}
+
+		std::vector<bool> trailingWhile(tk.size(), false); // 'while' closing a do loop
+
+		for(size_t i = 0; i < tk.size(); i++)
+		{
+			if(tk[i].token == TK_DO)
+			{
+				size_t close = match[i + 1], cond = close + 3, end = cond;
+				while(tk[end].token != TK_COMMAND_END)
+					end++;
+
+				trailingWhile[close + 1] = true;
+				plan_loop(tk, i, cond, end - 1, i + 2, close, end, true, flow, &plan);
+			}
+			else if(tk[i].token == TK_WHILE && !trailingWhile[i])
+			{
+				size_t scope = i;
+				while(tk[scope].token != TK_SCOPE_BEGIN)
+					scope++;
+
+				plan_loop(tk, i, i + 2, scope - 1, scope + 1, match[scope], match[scope], false, flow, &plan);
+			}
+		}
+
+		return plan;
+	}
+
+	// Closed form of a counting loop, in C or Lua syntax
+	template<typename Out>
+	inline static void write_closed_loop(Out& out, const sClosedLoop& c, bool lua)
+	{
+		bool anyLive = false;
+		for(auto& iv : c.inductions)
+			anyLive |= iv.live;
+
+		if(!anyLive) // Dead counting loop: nothing observable remains
+			return;
+
+		const int64_t k = c.step < 0 ? -c.step : c.step;
+		const std::string& v = c.var, &b = c.bound;
+		const char * end = lua ? "\n" : ";\n";
+
+		if(c.isDo) // First pass through the body. The tested variable always steps: the trip count reads it.
+			for(auto& iv : c.inductions)
+				if(iv.live || iv.var == v)
+					out << iv.var << " = " << iv.var << " + (" << iv.step << ")" << end;
+
+		// Trip count: ceil(distance / k) for strict tests, floor(distance / k) + 1 otherwise
+		std::string count;
+		if(lua)
+		{
+			if(c.op == ">")		  count = "-((" + b + " - " + v + ") // " + std::to_string(k) + ")";
+			else if(c.op == ">=") count = "(" + v + " - " + b + ") // " + std::to_string(k) + " + 1";
+			else if(c.op == "<")  count = "-((" + v + " - " + b + ") // " + std::to_string(k) + ")";
+			else				  count = "(" + b + " - " + v + ") // " + std::to_string(k) + " + 1";
+
+			out << "if " << v << " " << c.op << " " << b << " then\n\tlocal zc_n = " << count << "\n";
+		}
+		else
+		{
+			const std::string from = c.op[0] == '>' ? v : b, to = c.op[0] == '>' ? b : v;
+			if(c.op.size() == 1) count = "((long long)" + from + " - " + to + " + " + std::to_string(k - 1) + ") / " + std::to_string(k);
+			else				 count = "((long long)" + from + " - " + to + ") / " + std::to_string(k) + " + 1";
+
+			out << "if(" << v << " " << c.op << " " << b << ")\n{\n\tlong long zc_n = " << count << ";\n";
+		}
+
+		for(auto& iv : c.inductions)
+			if(iv.live)
+				out << "\t" << iv.var << " = " << iv.var << " + zc_n * (" << iv.step << ")" << end;
+
+		out << (lua ? "end\n" : "}\n");
+	}
+
+	// Opens the scope holding a reduced loop's temporaries. The init runs even when the loop does not, and the
+	// stride once past the last product, so C keeps them unsigned: wrapping where the original never overflowed.
+	template<typename Out>
+	inline static void write_reduced_inits(Out& out, const sReducedLoop& r, bool lua)
+	{
+		if(lua)
+		{
+			out << "do\n";
+			for(auto& init : r.inits)
+				out << "local zc_sr" << init.temp << " = (" << init.var << " + (" << init.offset << ")) * (" << init.factor << ")\n";
+			return;
+		}
+
+		out << "{\n";
+		for(auto& init : r.inits)
+			out << "unsigned zc_sr" << init.temp << " = ((unsigned)" << init.var << " + " << uint32_t(init.offset) << "u) * "
+				<< uint32_t(init.factor) << "u;\n";
+	}
+
+	template<typename Out>
+	inline static void write_reduced_product(Out& out, const sReducedProduct& p, bool lua)
+	{
+		if(lua)
+			out << p.target << " = zc_sr" << p.temp << "\n"
+				<< "zc_sr" << p.temp << " = zc_sr" << p.temp << " + (" << p.stride << ")\n";
+		else
+			out << p.target << " = (int)zc_sr" << p.temp << ";\n"
+				<< "zc_sr" << p.temp << " = zc_sr" << p.temp << " + " << uint32_t(p.stride) << "u;\n";
+	}
+
+	// Writes the planned rewrite starting at 'it', if any. Returns true when the rewrite replaced
+	// the tokens up to the new 'it'; false when they must still be emitted as usual.
+	template<typename Out>
+	inline static bool write_planned(token_it& it, token_it begin, const sLoopPlan& plan, Out& out, bool lua)
+	{
+		const size_t i = it - begin;
+
+		auto closed = plan.closed.find(i);
+		if(closed != plan.closed.end())
+		{
+			write_closed_loop(out, closed->second, lua);
+			it = begin + closed->second.end;
+			return true;
+		}
+
+		auto product = plan.products.find(i);
+		if(product != plan.products.end())
+		{
+			write_reduced_product(out, product->second, lua);
+			it = begin + product->second.end;
+			return true;
+		}
+
+		auto reduced = plan.reduced.find(i);
+		if(reduced != plan.reduced.end())
+			write_reduced_inits(out, reduced->second, lua);
+
+		return false;
+	}
+}
+}
@@ -0,0 +1,1068 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include "tokens.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Lua 5.4 opcodes used by the bytecode backend, numbered as in lopcodes.h
+	enum enLuaOp : uint8_t
+	{
+		LOP_MOVE = 0,
+		LOP_LOADI = 1,
+		LOP_LOADK = 3,
+		LOP_LOADKX = 4,
+		LOP_LOADFALSE = 5,
+		LOP_LOADTRUE = 7,
+		LOP_LOADNIL = 8,
+		LOP_GETUPVAL = 9,
+		LOP_SETUPVAL = 10,
+		LOP_GETTABUP = 11,
+		LOP_GETFIELD = 14,
+		LOP_SETTABUP = 15,
+		LOP_SETTABLE = 16,
+		LOP_NEWTABLE = 19,
+		LOP_ADDI = 21,
+		LOP_ADD = 34,
+		LOP_SUB = 35,
+		LOP_MUL = 36,
+		LOP_DIV = 39,
+		LOP_MMBIN = 46,
+		LOP_MMBINI = 47,
+		LOP_LEN = 52,
+		LOP_CONCAT = 53,
+		LOP_JMP = 56,
+		LOP_EQ = 57,
+		LOP_LT = 58,
+		LOP_LE = 59,
+		LOP_TEST = 66,
+		LOP_CALL = 68,
+		LOP_RETURN = 70,
+		LOP_RETURN0 = 71,
+		LOP_RETURN1 = 72,
+		LOP_CLOSURE = 79,
+		LOP_VARARGPREP = 81,
+		LOP_EXTRAARG = 82,
+	};
+
+	// Metamethod events (ltm.h), operand of the MMBIN that follows every arithmetic instruction
+	enum enLuaEvent : uint8_t
+	{
+		LTM_ADD = 6,
+		LTM_SUB = 7,
+		LTM_MUL = 8,
+		LTM_DIV = 11,
+	};
+
+	// Instruction fields (lopcodes.h): op 7 bits, A 8, k 1, B 8, C 8; Bx and sJ take the bits after A and op
+	inline static constexpr int s_luaOffsetSBx = (1 << 17) / 2 - 1;
+	inline static constexpr int s_luaOffsetSJ = (1 << 25) / 2 - 1;
+	inline static constexpr int s_luaOffsetSC = (1 << 8) / 2 - 1;
+	inline static constexpr uint32_t s_luaMaxBx = (1 << 17) - 1;
+	inline static constexpr uint32_t s_luaMaxAx = (1 << 25) - 1;
+	inline static constexpr int s_luaMaxRegisters = 250; // Lua allows 255; the rest is headroom for calls
+
+	inline static uint32_t lua_abc(enLuaOp op, int a, int b, int c, bool k = false)
+	{
+		return op | uint32_t(a) << 7 | uint32_t(k) << 15 | uint32_t(b) << 16 | uint32_t(c) << 24;
+	}
+
+	inline static uint32_t lua_abx(enLuaOp op, int a, uint32_t bx)
+	{
+		return op | uint32_t(a) << 7 | bx << 15;
+	}
+
+	inline static uint32_t lua_ax(enLuaOp op, uint32_t ax)
+	{
+		return op | ax << 7;
+	}
+
+	inline static uint32_t lua_asbx(enLuaOp op, int a, int sbx)
+	{
+		return lua_abx(op, a, uint32_t(sbx + s_luaOffsetSBx));
+	}
+
+	struct sLuaConstant
+	{
+		uint8_t tag; // Type tag as dumped: 3 integer, 19 float, 4/20 short/long string
+		int64_t integer;
+		double number;
+		std::string string;
+	};
+
+	struct sLuaUpvalue
+	{
+		bool inStack; // Register of the enclosing function, else one of its upvalues
+		uint8_t index;
+		std::string name;
+	};
+
+	struct sLuaLocal
+	{
+		std::string name;
+		uint32_t startPc, endPc;
+	};
+
+	// One function prototype under construction, with what luac would dump for it
+	struct sLuaProto
+	{
+		uint8_t params = 0;
+		bool vararg = false;
+		uint8_t maxStack = 2;
+		std::string source; // Empty for nested functions, which inherit their parent's
+
+		std::vector<uint32_t> code;
+		std::vector<sLuaConstant> constants;
+		std::vector<sLuaUpvalue> upvalues;
+		std::vector<sLuaProto> protos;
+		std::vector<sLuaLocal> locals;
+
+		// Line info in the format of lcode.c's savelineinfo
+		std::vector<int8_t> lineInfo;
+		std::vector<std::pair<uint32_t, uint32_t>> absLineInfo;
+		int previousLine = 0;
+		int withoutAbs = 0;
+		bool jumpTooFar = false; // A jump did not fit its 25-bit offset
+		bool tooManyConstants = false; // A constant index did not fit even LOADKX's 25 bits
+
+		std::map<std::tuple<uint8_t, int64_t, std::string>, uint32_t> constantIds;
+
+		uint32_t emit(uint32_t instruction, int line)
+		{
+			code.push_back(instruction);
+
+			int diff = line - previousLine;
+			if(std::abs(diff) >= 0x80 || withoutAbs++ >= 128)
+			{
+				absLineInfo.push_back({uint32_t(code.size() - 1), uint32_t(line)});
+				diff = -0x80;
+				withoutAbs = 1;
+			}
+			lineInfo.push_back(int8_t(diff));
+			previousLine = line;
+
+			return code.size() - 1;
+		}
+
+		void touch(int reg)
+		{
+			if(reg + 1 > maxStack)
+				maxStack = reg + 1;
+		}
+
+		uint32_t constant(uint8_t tag, int64_t bits, const std::string& s)
+		{
+			auto find = constantIds.find({tag, bits, s});
+			if(find != constantIds.end())
+				return find->second;
+
+			sLuaConstant k{tag, bits, 0, s};
+			std::memcpy(&k.number, &bits, sizeof(double));
+			constants.push_back(k);
+			return constantIds[{tag, bits, s}] = constants.size() - 1;
+		}
+
+		uint32_t constant(int64_t v) { return constant(3, v, ""); }
+		uint32_t constant(std::string_view s) { return constant(s.size() <= 40 ? 4 : 20, 0, std::string(s)); }
+		uint32_t constant(double v)
+		{
+			int64_t bits;
+			std::memcpy(&bits, &v, sizeof(double));
+			return constant(19, bits, "");
+		}
+
+		// Jump to be patched later
+		uint32_t jump(int line)
+		{
+			return emit(LOP_JMP, line);
+		}
+
+		void patch(uint32_t jmp, uint32_t target)
+		{
+			if(std::abs(int64_t(target) - int64_t(jmp) - 1) > s_luaOffsetSJ)
+				jumpTooFar = true;
+			code[jmp] = LOP_JMP | uint32_t(int(target) - int(jmp) - 1 + s_luaOffsetSJ) << 7;
+		}
+
+		void patchHere(const std::vector<uint32_t>& jumps)
+		{
+			for(uint32_t j : jumps)
+				patch(j, code.size());
+		}
+
+		// GETTABUP needs the key among the first 256 constants
+		void getGlobal(int reg, uint8_t env, std::string_view name, int line)
+		{
+			emit(lua_abc(LOP_GETTABUP, reg, env, constant(name)), line);
+			touch(reg);
+		}
+
+		void getField(int reg, int table, std::string_view name, int line)
+		{
+			emit(lua_abc(LOP_GETFIELD, reg, table, constant(name)), line);
+			touch(reg);
+		}
+
+		// LOADK reaches the first 2^17 constants; past them the index goes in an EXTRAARG after LOADKX
+		void loadConstant(int reg, uint32_t k, int line)
+		{
+			if(k <= s_luaMaxBx)
+				emit(lua_abx(LOP_LOADK, reg, k), line);
+			else
+			{
+				if(k > s_luaMaxAx)
+					tooManyConstants = true;
+				emit(lua_abx(LOP_LOADKX, reg, 0), line);
+				emit(lua_ax(LOP_EXTRAARG, k), line);
+			}
+			touch(reg);
+		}
+
+		void loadInt(int reg, int64_t v, int line)
+		{
+			if(v >= -s_luaOffsetSBx && v <= s_luaOffsetSBx + 1)
+			{
+				emit(lua_asbx(LOP_LOADI, reg, int(v)), line);
+				touch(reg);
+			}
+			else loadConstant(reg, constant(v), line);
+		}
+
+		void loadNumber(int reg, double v, int line)
+		{
+			loadConstant(reg, constant(v), line);
+		}
+
+		void loadString(int reg, std::string_view s, int line)
+		{
+			loadConstant(reg, constant(s), line);
+		}
+
+		// R[reg] := R[reg] + imm, with the MMBINI the VM falls back to on non-numbers
+		void addImmediate(int dest, int reg, int imm, enLuaEvent event, int line)
+		{
+			emit(lua_abc(LOP_ADDI, dest, reg, imm + s_luaOffsetSC), line);
+			emit(lua_abc(LOP_MMBINI, reg, (event == LTM_SUB ? -imm : imm) + s_luaOffsetSC, event), line);
+			touch(dest);
+		}
+
+		void arith(enLuaOp op, enLuaEvent event, int dest, int l, int r, int line)
+		{
+			emit(lua_abc(op, dest, l, r), line);
+			emit(lua_abc(LOP_MMBIN, l, r, event), line);
+			touch(dest);
+		}
+
+		void call(int reg, int args, int results, int line)
+		{
+			emit(lua_abc(LOP_CALL, reg, args + 1, results + 1), line);
+			touch(reg + std::max(args, results));
+		}
+
+		// Next instruction (a jump) is skipped when R[reg]'s truthiness differs from 'k'
+		void test(int reg, bool k, int line)
+		{
+			emit(lua_abc(LOP_TEST, reg, 0, 0, k), line);
+		}
+	};
+
+	// Writes 'proto' as a Lua 5.4 binary chunk (lundump.c), loadable by the stock interpreter
+	struct sLuaDumper
+	{
+		std::string out;
+
+		void byte(uint8_t b) { out += char(b); }
+
+		template<typename T>
+		void raw(T v)
+		{
+			char bytes[sizeof(T)];
+			std::memcpy(bytes, &v, sizeof(T));
+			out.append(bytes, sizeof(T));
+		}
+
+		// MSB-first groups of 7 bits, the last one flagged with 0x80
+		void size(size_t x)
+		{
+			uint8_t buffer[16];
+			int n = 0;
+			do
+			{
+				buffer[sizeof(buffer) - ++n] = x & 0x7f;
+				x >>= 7;
+			} while(x);
+			buffer[sizeof(buffer) - 1] |= 0x80;
+			out.append(reinterpret_cast<char*>(buffer + sizeof(buffer) - n), n);
+		}
+
+		void string(const std::string* s)
+		{
+			if(!s)
+				return size(0);
+			size(s->size() + 1);
+			out += *s;
+		}
+
+		void header(uint8_t upvalues)
+		{
+			out += "\x1bLua";
+			byte(0x54);							  // Version
+			byte(0);							  // Format
+			out += std::string("\x19\x93\r\n\x1a\n", 6);
+			byte(sizeof(uint32_t));				  // Instruction
+			byte(sizeof(int64_t));				  // lua_Integer
+			byte(sizeof(double));				  // lua_Number
+			raw<int64_t>(0x5678);
+			raw<double>(370.5);
+			byte(upvalues);
+		}
+
+		void function(const sLuaProto& p)
+		{
+			string(p.source.empty() ? nullptr : &p.source);
+			size(0); // linedefined
+			size(0); // lastlinedefined
+			byte(p.params);
+			byte(p.vararg);
+			byte(p.maxStack);
+
+			size(p.code.size());
+			for(uint32_t i : p.code)
+				raw(i);
+
+			size(p.constants.size());
+			for(auto& k : p.constants)
+			{
+				byte(k.tag);
+				if(k.tag == 3)
+					raw(k.integer);
+				else if(k.tag == 19)
+					raw(k.number);
+				else string(&k.string);
+			}
+
+			size(p.upvalues.size());
+			for(auto& u : p.upvalues)
+			{
+				byte(u.inStack);
+				byte(u.index);
+				byte(0); // Regular variable
+			}
+
+			size(p.protos.size());
+			for(auto& child : p.protos)
+				function(child);
+
+			size(p.lineInfo.size());
+			for(int8_t l : p.lineInfo)
+				byte(uint8_t(l));
+
+			size(p.absLineInfo.size());
+			for(auto& a : p.absLineInfo)
+			{
+				size(a.first);
+				size(a.second);
+			}
+
+			size(p.locals.size());
+			for(auto& l : p.locals)
+			{
+				string(&l.name);
+				size(l.startPc);
+				size(l.endPc);
+			}
+
+			size(p.upvalues.size());
+			for(auto& u : p.upvalues)
+				string(&u.name);
+		}
+	};
+
+	// Registers of the main function holding the runtime's state, captured by its closures
+	enum enLuaRuntimeReg : uint8_t
+	{
+		LR_OUT,
+		LR_N,
+		LR_IN,
+		LR_POS,
+		LR_WRITE,
+		LR_CONCAT,
+		LR_FIND,
+		LR_SUB,
+		LR_READ_CHUNK,
+		LR_LINE_FLUSH,
+		LR_FLUSH,
+		LR_PRINT,
+		LR_PRINT_TEXT,
+		LR_READ,
+		LR_COUNT
+	};
+
+	inline static const char * s_luaRuntimeNames[LR_COUNT] =
+	{
+		"zc_out", "zc_n", "zc_in", "zc_pos", "zc_write", "zc_concat", "zc_find", "zc_sub", "zc_read_chunk",
+		"zc_line_flush", "zc_flush", "zc_print", "zc_print_text", "zc_read"
+	};
+
+	// Nested function capturing main's _ENV and the given runtime registers. Upvalue i + 1 is regs[i].
+	inline static sLuaProto lua_runtime_function(std::initializer_list<enLuaRuntimeReg> regs, uint8_t params)
+	{
+		sLuaProto p;
+		p.params = params;
+		p.upvalues.push_back({false, 0, "_ENV"});
+		for(auto r : regs)
+			p.upvalues.push_back({true, uint8_t(r), s_luaRuntimeNames[r]});
+		return p;
+	}
+
+	// Same behavior as zc_flush in s_luaRuntime
+	inline static sLuaProto lua_runtime_flush()
+	{
+		enum { U_OUT = 1, U_N, U_WRITE, U_CONCAT };
+		sLuaProto p = lua_runtime_function({LR_OUT, LR_N, LR_WRITE, LR_CONCAT}, 0);
+
+		p.emit(lua_abc(LOP_GETUPVAL, 0, U_WRITE, 0), 0); // zc_write(zc_concat(zc_out, "", 1, zc_n))
+		p.emit(lua_abc(LOP_GETUPVAL, 1, U_CONCAT, 0), 0);
+		p.emit(lua_abc(LOP_GETUPVAL, 2, U_OUT, 0), 0);
+		p.loadString(3, "", 0);
+		p.loadInt(4, 1, 0);
+		p.emit(lua_abc(LOP_GETUPVAL, 5, U_N, 0), 0);
+		p.call(1, 4, 1, 0);
+		p.call(0, 1, 0, 0);
+		p.loadInt(0, 0, 0); // zc_n = 0
+		p.emit(lua_abc(LOP_SETUPVAL, 0, U_N, 0), 0);
+		p.emit(lua_abc(LOP_RETURN0, 0, 0, 0), 0);
+		return p;
+	}
+
+	// Same behavior as zc_print in s_luaRuntime, or zc_print_text when 'text' is set
+	inline static sLuaProto lua_runtime_print(bool text)
+	{
+		enum { U_OUT = 1, U_N, U_LINE_FLUSH, U_FLUSH };
+		sLuaProto p = lua_runtime_function({LR_OUT, LR_N, LR_LINE_FLUSH, LR_FLUSH}, 1);
+
+		if(!text) // if v == nil then v = "nil" end
+		{
+			p.test(0, true, 0);
+			const uint32_t notNil = p.jump(0);
+			p.loadString(0, "nil", 0);
+			p.patchHere({notNil});
+		}
+
+		p.emit(lua_abc(LOP_GETUPVAL, 1, U_OUT, 0), 0); // zc_out[zc_n + 1] = v, then "\n" after values
+		p.emit(lua_abc(LOP_GETUPVAL, 2, U_N, 0), 0);
+		p.addImmediate(2, 2, 1, LTM_ADD, 0);
+		p.emit(lua_abc(LOP_SETTABLE, 1, 2, 0), 0);
+		if(!text)
+		{
+			p.addImmediate(2, 2, 1, LTM_ADD, 0);
+			p.emit(lua_abc(LOP_SETTABLE, 1, 2, p.constant(std::string("\n")), true), 0);
+		}
+		p.emit(lua_abc(LOP_SETUPVAL, 2, U_N, 0), 0);
+
+		p.emit(lua_abc(LOP_GETUPVAL, 3, U_LINE_FLUSH, 0), 0); // if zc_line_flush or zc_n >= 8192
+		p.test(3, false, 0);
+		const uint32_t checkSize = p.jump(0);
+		const uint32_t flushNow = p.jump(0);
+		p.patchHere({checkSize});
+		p.loadInt(4, 8192, 0);
+		p.emit(lua_abc(LOP_LE, 4, 2, 0, true), 0);
+		const uint32_t flushFull = p.jump(0);
+		p.emit(lua_abc(LOP_RETURN0, 0, 0, 0), 0);
+
+		p.patchHere({flushNow, flushFull}); // zc_flush() io.flush()
+		p.emit(lua_abc(LOP_GETUPVAL, 0, U_FLUSH, 0), 0);
+		p.call(0, 0, 0, 0);
+		p.getGlobal(0, 0, "io", 0);
+		p.getField(0, 0, "flush", 0);
+		p.call(0, 0, 0, 0);
+		p.emit(lua_abc(LOP_RETURN0, 0, 0, 0), 0);
+		return p;
+	}
+
+	// Same behavior as zc_read in s_luaRuntime
+	inline static sLuaProto lua_runtime_read()
+	{
+		enum { U_IN = 1, U_POS, U_FIND, U_SUB, U_READ_CHUNK, U_LINE_FLUSH };
+		sLuaProto p = lua_runtime_function({LR_IN, LR_POS, LR_FIND, LR_SUB, LR_READ_CHUNK, LR_LINE_FLUSH}, 0);
+		enum { S, E, NUMBER, T1, T2, T3, T4 };
+
+		p.emit(lua_abc(LOP_GETUPVAL, S, U_LINE_FLUSH, 0), 0); // if zc_line_flush then return io.read("n") end
+		p.test(S, false, 0);
+		const uint32_t buffered = p.jump(0);
+		p.getGlobal(S, 0, "io", 0);
+		p.getField(S, S, "read", 0);
+		p.loadString(E, "n", 0);
+		p.call(S, 1, 1, 0);
+		p.emit(lua_abc(LOP_RETURN1, S, 0, 0), 0);
+
+		p.patchHere({buffered}); // local s, e, number = zc_find(zc_in, "^%s*([-+]?%d+)", zc_pos)
+		const uint32_t loop = p.code.size();
+		p.emit(lua_abc(LOP_GETUPVAL, S, U_FIND, 0), 0);
+		p.emit(lua_abc(LOP_GETUPVAL, E, U_IN, 0), 0);
+		p.loadString(NUMBER, "^%s*([-+]?%d+)", 0);
+		p.emit(lua_abc(LOP_GETUPVAL, T1, U_POS, 0), 0);
+		p.call(S, 3, 3, 0);
+
+		p.test(S, false, 0); // if s and e < #zc_in then found
+		const uint32_t noMatch = p.jump(0);
+		p.emit(lua_abc(LOP_GETUPVAL, T1, U_IN, 0), 0);
+		p.emit(lua_abc(LOP_LEN, T2, T1, 0), 0);
+		p.emit(lua_abc(LOP_LT, E, T2, 0), 0);
+		const uint32_t atEnd = p.jump(0);
+		const uint32_t found = p.jump(0);
+
+		p.patchHere({noMatch, atEnd}); // if not s and not zc_find(zc_in, "^%s*[-+]?$", zc_pos) then return nil end
+		p.test(S, true, 0);
+		const uint32_t partial = p.jump(0);
+		p.emit(lua_abc(LOP_GETUPVAL, T1, U_FIND, 0), 0);
+		p.emit(lua_abc(LOP_GETUPVAL, T2, U_IN, 0), 0);
+		p.loadString(T3, "^%s*[-+]?$", 0);
+		p.emit(lua_abc(LOP_GETUPVAL, T4, U_POS, 0), 0);
+		p.call(T1, 3, 1, 0);
+		p.test(T1, false, 0);
+		const uint32_t invalid = p.jump(0);
+
+		p.patchHere({partial}); // local chunk = zc_read_chunk(1 << 16)
+		p.emit(lua_abc(LOP_GETUPVAL, T1, U_READ_CHUNK, 0), 0);
+		p.loadInt(T2, 1 << 16, 0);
+		p.call(T1, 1, 1, 0);
+		p.test(T1, false, 0);
+		const uint32_t noChunk = p.jump(0);
+
+		p.emit(lua_abc(LOP_GETUPVAL, T2, U_SUB, 0), 0); // zc_in = zc_sub(zc_in, zc_pos) .. chunk; zc_pos = 1
+		p.emit(lua_abc(LOP_GETUPVAL, T3, U_IN, 0), 0);
+		p.emit(lua_abc(LOP_GETUPVAL, T4, U_POS, 0), 0);
+		p.call(T2, 2, 1, 0);
+		p.emit(lua_abc(LOP_MOVE, T3, T1, 0), 0);
+		p.emit(lua_abc(LOP_CONCAT, T2, 2, 0), 0);
+		p.emit(lua_abc(LOP_SETUPVAL, T2, U_IN, 0), 0);
+		p.loadInt(T2, 1, 0);
+		p.emit(lua_abc(LOP_SETUPVAL, T2, U_POS, 0), 0);
+		p.patch(p.jump(0), loop);
+
+		p.patchHere({noChunk}); // Input ended: a pending match is the last number
+		p.test(S, false, 0);
+		const uint32_t none = p.jump(0);
+
+		p.patchHere({found}); // zc_pos = e + 1; return tonumber(number)
+		p.addImmediate(T1, E, 1, LTM_ADD, 0);
+		p.emit(lua_abc(LOP_SETUPVAL, T1, U_POS, 0), 0);
+		p.getGlobal(T1, 0, "tonumber", 0);
+		p.emit(lua_abc(LOP_MOVE, T2, NUMBER, 0), 0);
+		p.call(T1, 1, 1, 0);
+		p.emit(lua_abc(LOP_RETURN1, T1, 0, 0), 0);
+
+		p.patchHere({invalid, none});
+		p.emit(lua_abc(LOP_LOADNIL, T1, 0, 0), 0);
+		p.emit(lua_abc(LOP_RETURN1, T1, 0, 0), 0);
+		return p;
+	}
+
+	// Operand of an expression: a register, or a literal not loaded yet
+	struct sLuaExp
+	{
+		enum { REG, TEMP, INT, NUM } kind;
+		int reg;
+		int64_t integer;
+		double number;
+	};
+
+	// Direct Lua 5.4 bytecode backend. Program variables live in registers, after the runtime's;
+	// the rest of the stack holds expression temporaries.
+	struct sLuaCodegen
+	{
+		const token_vector& tk;
+		sLuaProto main;
+		std::map<std::string, int, std::less<>> registers; // Variables that did not fit become globals
+		int top = LR_COUNT;
+		bool failed = false;
+
+		sLuaCodegen(const token_vector& tokens)
+			: tk(tokens){}
+
+		int allocate()
+		{
+			if(top >= s_luaMaxRegisters)
+			{
+				failed = true;
+				return top - 1;
+			}
+			main.touch(top);
+			return top++;
+		}
+
+		void release(const sLuaExp& e)
+		{
+			if(e.kind == sLuaExp::TEMP)
+				top--;
+		}
+
+		sLuaExp toRegister(sLuaExp e, int line)
+		{
+			if(e.kind == sLuaExp::INT || e.kind == sLuaExp::NUM)
+			{
+				const int reg = allocate();
+				if(e.kind == sLuaExp::INT)
+					main.loadInt(reg, e.integer, line);
+				else main.loadNumber(reg, e.number, line);
+				return {sLuaExp::TEMP, reg, 0, 0};
+			}
+			return e;
+		}
+
+		sLuaExp variable(const sToken& t)
+		{
+			auto find = registers.find(t.view());
+			if(find != registers.end())
+				return {sLuaExp::REG, find->second, 0, 0};
+
+			const int reg = allocate();
+			if(main.constant(t.view()) > 0xff)
+				failed = true;
+			main.getGlobal(reg, 0, t.view(), t.line);
+			return {sLuaExp::TEMP, reg, 0, 0};
+		}
+
+		void store(const sToken& t, int reg)
+		{
+			auto find = registers.find(t.view());
+			if(find == registers.end())
+			{
+				if(main.constant(t.view()) > 0xff)
+					failed = true;
+				main.emit(lua_abc(LOP_SETTABUP, 0, main.constant(t.view()), reg), t.line);
+			}
+			else if(find->second != reg)
+				main.emit(lua_abc(LOP_MOVE, find->second, reg, 0), t.line);
+		}
+
+		// Numerals as Lua reads them: decimal unless prefixed with 0x. ';' is this language's decimal point.
+		static sLuaExp literal(const sToken& t)
+		{
+			std::string s(t.view());
+			s.erase(std::remove(s.begin(), s.end(), 'f'), s.end());
+			std::replace(s.begin(), s.end(), ';', '.');
+
+			if(t.token == TK_INT)
+			{
+				errno = 0;
+				const bool hex = s.size() > 1 && s[1] == 'x';
+				const long long v = std::strtoll(s.c_str() + (hex ? 2 : 0), nullptr, hex ? 16 : 10);
+				if(errno != ERANGE)
+					return {sLuaExp::INT, 0, v, 0};
+			}
+			return {sLuaExp::NUM, 0, 0, std::strtod(s.c_str(), nullptr)};
+		}
+
+		sLuaExp binary(const sToken& op, sLuaExp l, sLuaExp r)
+		{
+			const char c = op.str[0];
+			l = toRegister(l, op.line);
+
+			if((c == '+' || c == '-') && r.kind == sLuaExp::INT && r.integer >= -s_luaOffsetSC && r.integer <= s_luaOffsetSC)
+			{
+				release(l);
+				const int dest = allocate();
+				main.addImmediate(dest, l.reg, int(c == '+' ? r.integer : -r.integer), c == '+' ? LTM_ADD : LTM_SUB, op.line);
+				return {sLuaExp::TEMP, dest, 0, 0};
+			}
+
+			r = toRegister(r, op.line);
+			release(r);
+			release(l);
+			const int dest = allocate();
+
+			switch(c)
+			{
+				case '+': main.arith(LOP_ADD, LTM_ADD, dest, l.reg, r.reg, op.line); break;
+				case '-': main.arith(LOP_SUB, LTM_SUB, dest, l.reg, r.reg, op.line); break;
+				case '*': main.arith(LOP_MUL, LTM_MUL, dest, l.reg, r.reg, op.line); break;
+				default:  main.arith(LOP_DIV, LTM_DIV, dest, l.reg, r.reg, op.line); break;
+			}
+			return {sLuaExp::TEMP, dest, 0, 0};
+		}
+
+		// Expr -> Term ((+ | -) Term)*, Term -> Factor ((* | /) Factor)*, Factor -> id | int | float | double | '(' Expr ')'.
+		// Operator precedence parsing over explicit stacks, so parentheses nest without recursion.
+		// Leaves 'i' on the first token after the expression.
+		sLuaExp expr(size_t& i)
+		{
+			std::vector<sLuaExp> values;
+			std::vector<const sToken*> operators; // Pending operators and open parentheses
+			size_t depth = 0;
+
+			const auto precedence = [](const sToken* t)
+			{
+				return t->token == TK_OP_MULTDIV ? 2 : t->token == TK_OP_ADDSUB ? 1 : 0;
+			};
+
+			const auto reduce = [&]
+			{
+				const sLuaExp r = values.back();
+				values.pop_back();
+				values.back() = binary(*operators.back(), values.back(), r);
+				operators.pop_back();
+			};
+
+			for(;; i++)
+			{
+				const sToken& t = tk[i];
+				if(t.token == TK_PARENTH_BEGIN)
+				{
+					operators.push_back(&t);
+					depth++;
+				}
+				else if(t.token == TK_PARENTH_END && depth)
+				{
+					while(operators.back()->token != TK_PARENTH_BEGIN)
+						reduce();
+					operators.pop_back();
+					depth--;
+				}
+				else if(t.token == TK_OP_ADDSUB || t.token == TK_OP_MULTDIV)
+				{
+					while(!operators.empty() && precedence(operators.back()) >= precedence(&t))
+						reduce();
+					operators.push_back(&t);
+				}
+				else if(t.token == TK_ID)
+					values.push_back(variable(t));
+				else if(t.token == TK_INT || t.token == TK_FLOAT || t.token == TK_DOUBLE)
+					values.push_back(literal(t));
+				else break;
+			}
+
+			while(!operators.empty())
+				reduce();
+			return values.back();
+		}
+
+		// Logicterm -> Expr relop Expr. Emits a test and the jump taken when the relation is 'jumpWhen'.
+		uint32_t relation(size_t& i, bool jumpWhen)
+		{
+			sLuaExp l = toRegister(expr(i), tk[i].line);
+			const sToken& op = tk[i++];
+			sLuaExp r = toRegister(expr(i), op.line);
+			release(r);
+			release(l);
+
+			enLuaOp code = LOP_EQ;
+			int a = l.reg, b = r.reg;
+			bool negated = false;
+
+			if(op.str == "<")
+				code = LOP_LT;
+			else if(op.str == ">")
+				code = LOP_LT, std::swap(a, b);
+			else if(op.str == "<=")
+				code = LOP_LE;
+			else if(op.str == ">=")
+				code = LOP_LE, std::swap(a, b);
+			else negated = op.str[0] == '!';
+
+			// The jump right after the test runs when the relation equals k
+			main.emit(lua_abc(code, a, b, 0, jumpWhen != negated), op.line);
+			return main.jump(op.line);
+		}
+
+		// Logicexpr -> Logicterm ((e | ou) Logicterm)*, 'e' binding tighter than 'ou'.
+		// Returns the jumps taken when the condition is false; falls through when it holds.
+		std::vector<uint32_t> condition(size_t& i)
+		{
+			std::vector<uint32_t> whenTrue, whenFalse;
+
+			while(true)
+			{
+				uint32_t jump = relation(i, false);
+
+				if(tk[i].token == TK_OP_AND)
+				{
+					whenFalse.push_back(jump);
+					i++;
+					continue;
+				}
+
+				if(tk[i].token != TK_OP_OR)
+				{
+					whenFalse.push_back(jump);
+					break;
+				}
+
+				// Last term of a group followed by 'ou': its test is flipped to leave the condition when true
+				main.code[jump - 1] ^= 1u << 15;
+				whenTrue.push_back(jump);
+				main.patchHere(whenFalse); // Earlier terms of the group fail into the next group
+				whenFalse.clear();
+				i++;
+			}
+
+			main.patchHere(whenTrue);
+			return whenFalse;
+		}
+
+		void prologue(const sToken& t, bool lineFlush)
+		{
+			main.source = "=zcompiler";
+			main.vararg = true;
+			main.upvalues.push_back({true, 0, "_ENV"});
+			main.emit(lua_abc(LOP_VARARGPREP, 0, 0, 0), t.line);
+
+			main.emit(lua_abc(LOP_NEWTABLE, LR_OUT, 0, 0), t.line);
+			main.emit(lua_abc(LOP_EXTRAARG, 0, 0, 0), t.line);
+			main.loadInt(LR_N, 0, t.line);
+			main.loadString(LR_IN, "", t.line);
+			main.loadInt(LR_POS, 1, t.line);
+
+			const std::pair<const char *, const char *> functions[] =
+				{{"io", "write"}, {"table", "concat"}, {"string", "find"}, {"string", "sub"}, {"io", "read"}};
+			for(int r = LR_WRITE; r <= LR_READ_CHUNK; r++)
+			{
+				main.getGlobal(r, 0, functions[r - LR_WRITE].first, t.line);
+				main.getField(r, r, functions[r - LR_WRITE].second, t.line);
+			}
+
+			main.emit(lua_abc(lineFlush ? LOP_LOADTRUE : LOP_LOADFALSE, LR_LINE_FLUSH, 0, 0), t.line);
+
+			main.protos = {lua_runtime_flush(), lua_runtime_print(false), lua_runtime_print(true), lua_runtime_read()};
+			for(int r = LR_FLUSH; r <= LR_READ; r++)
+				main.emit(lua_abx(LOP_CLOSURE, r, r - LR_FLUSH), t.line);
+		}
+
+		// Declared variables take the registers after the runtime's, as long as enough room is left for temporaries
+		void declare(size_t& i)
+		{
+			const int first = top;
+			while(tk[++i].token != TK_COMMAND_END)
+				if(tk[i].token == TK_ID && !registers.count(tk[i].view()) && top < s_luaMaxRegisters - 50)
+					registers.emplace(tk[i].view(), top++);
+
+			if(top > first)
+			{
+				main.emit(lua_abc(LOP_LOADNIL, first, top - first - 1, 0), tk[i].line);
+				main.touch(top - 1);
+			}
+		}
+
+		// Unescapes a text literal the way Lua reads a quoted string
+		static std::string text(std::string_view quoted)
+		{
+			std::string out;
+			for(size_t i = 1; i + 1 < quoted.size(); i++)
+			{
+				if(quoted[i] != '\\')
+				{
+					out += quoted[i];
+					continue;
+				}
+
+				const char c = quoted[++i];
+				switch(c)
+				{
+					case 'n': out += '\n'; break;
+					case 't': out += '\t'; break;
+					case 'r': out += '\r'; break;
+					case 'a': out += '\a'; break;
+					case 'b': out += '\b'; break;
+					case 'f': out += '\f'; break;
+					case 'v': out += '\v'; break;
+					case 'x':
+						out += char(std::strtol(std::string(quoted.substr(i + 1, 2)).c_str(), nullptr, 16));
+						i += 2;
+						break;
+					default:
+						if(c >= '0' && c <= '9')
+						{
+							size_t digits = 1;
+							while(digits < 3 && quoted[i + digits] >= '0' && quoted[i + digits] <= '9')
+								digits++;
+							out += char(std::stoi(std::string(quoted.substr(i, digits))));
+							i += digits - 1;
+						}
+						else out += c;
+				}
+			}
+			return out;
+		}
+
+		struct sFrame
+		{
+			enToken kind;
+			uint32_t start;				// First instruction of a do body or while condition
+			std::vector<uint32_t> exits; // Jumps leaving the construct
+		};
+
+		// Walks the checked program once. Constructs are tracked on an explicit stack.
+		bool generate(bool lineFlush)
+		{
+			std::vector<sFrame> frames;
+
+			for(size_t i = 0; i < tk.size(); i++)
+			{
+				const sToken& t = tk[i];
+				switch(t.token)
+				{
+					case TK_INIT:
+						prologue(t, lineFlush);
+						break;
+					case TK_DECLARE:
+						declare(i);
+						break;
+					case TK_ID: // id := Expr .
+					{
+						i += 2;
+						sLuaExp e = toRegister(expr(i), t.line);
+						store(t, e.reg);
+						release(e);
+						break;
+					}
+					case TK_PRINT: // escreva ( id | text ) .
+					{
+						const sToken& arg = tk[i + 2];
+						const int base = allocate();
+						const int value = allocate();
+						main.emit(lua_abc(LOP_MOVE, base, arg.token == TK_TEXT ? LR_PRINT_TEXT : LR_PRINT, 0), t.line);
+
+						if(arg.token == TK_TEXT)
+							main.loadString(value, text(arg.view()), t.line);
+						else if(registers.count(arg.view()))
+							main.emit(lua_abc(LOP_MOVE, value, registers.find(arg.view())->second, 0), t.line);
+						else
+						{
+							if(main.constant(arg.view()) > 0xff)
+								failed = true;
+							main.getGlobal(value, 0, arg.view(), t.line);
+						}
+
+						main.call(base, 1, 0, t.line);
+						top -= 2;
+						i += 4;
+						break;
+					}
+					case TK_READ: // leia ( id ) .
+					{
+						const int base = allocate();
+						main.emit(lua_abc(LOP_MOVE, base, LR_READ, 0), t.line);
+						main.call(base, 0, 1, t.line);
+						store(tk[i + 2], base);
+						top--;
+						i += 4;
+						break;
+					}
+					case TK_IF: // if ( Logicexpr ) {
+						i += 2;
+						frames.push_back({TK_IF, 0, condition(i)});
+						i++;
+						break;
+					case TK_WHILE: // while ( Logicexpr ) {
+					{
+						const uint32_t start = main.code.size();
+						i += 2;
+						frames.push_back({TK_WHILE, start, condition(i)});
+						i++;
+						break;
+					}
+					case TK_DO: // do {
+						frames.push_back({TK_DO, uint32_t(main.code.size()), {}});
+						i++;
+						break;
+					case TK_SCOPE_END:
+					{
+						sFrame f = std::move(frames.back());
+						frames.pop_back();
+
+						switch(f.kind)
+						{
+							case TK_IF:
+								if(tk[i + 1].token == TK_ELSE) // } else {
+								{
+									const uint32_t skipElse = main.jump(t.line);
+									main.patchHere(f.exits);
+									frames.push_back({TK_ELSE, 0, {skipElse}});
+									i += 2;
+								}
+								else main.patchHere(f.exits);
+								break;
+							case TK_ELSE:
+								main.patchHere(f.exits);
+								break;
+							case TK_WHILE:
+								main.patch(main.jump(t.line), f.start);
+								main.patchHere(f.exits);
+								break;
+							case TK_DO: // } while ( Logicexpr ) .
+							{
+								i += 3;
+								std::vector<uint32_t> exits = condition(i);
+								main.patch(main.jump(t.line), f.start);
+								main.patchHere(exits);
+								i++;
+								break;
+							}
+							default:
+								break;
+						}
+						break;
+					}
+					case TK_END: // zc_flush() at the end of the program
+					{
+						const int base = allocate();
+						main.emit(lua_abc(LOP_MOVE, base, LR_FLUSH, 0), t.line);
+						main.call(base, 0, 0, t.line);
+						top--;
+						main.emit(lua_abc(LOP_RETURN, base, 1, 1, true), t.line);
+						i = tk.size();
+						break;
+					}
+					case TK_INCLUDE: // Modules are linked as Lua source
+						return false;
+					default:
+						break;
+				}
+
+				if(failed)
+					return false;
+			}
+
+			if(main.jumpTooFar || main.tooManyConstants)
+				return false;
+
+			for(int r = 0; r < LR_COUNT; r++)
+				main.locals.push_back({s_luaRuntimeNames[r], 0, uint32_t(main.code.size())});
+			for(int r = LR_COUNT; r < LR_COUNT + int(registers.size()); r++)
+				for(auto& v : registers)
+					if(v.second == r)
+						main.locals.push_back({v.first, 0, uint32_t(main.code.size())});
+
+			return true;
+		}
+	};
+
+	// Compiles a checked program to a Lua 5.4 binary chunk. Returns an empty string for programs
+	// this backend does not handle, which then go through Lua source and luac.
+	inline static std::string emit_lua_bytecode(const token_vector& tokens, bool lineFlush)
+	{
+		if(tokens.empty() || tokens.front().token != TK_INIT)
+			return "";
+
+		sLuaCodegen gen(tokens);
+		if(!gen.generate(lineFlush))
+			return "";
+
+		sLuaDumper dump;
+		dump.header(gen.main.upvalues.size());
+		dump.function(gen.main);
+		return dump.out;
+	}
+}
+}
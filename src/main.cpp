@@ -15,22 +15,58 @@ inline static const std::map<std::string, enCompileFlags> s_flags =
 {
 	{"-lua", enCompileFlags::CF_LUA_COMPILE},
 	{"-autorun", enCompileFlags::CF_AUTORUN},
-	{"-token", enCompileFlags::CF_TOKEN_FILE}
+	{"-token", enCompileFlags::CF_TOKEN_FILE},
+	{"-multi", enCompileFlags::CF_MULTI_TARGET},
+	{"-mem", enCompileFlags::CF_MEM_REPORT},
+	{"-lineflush", enCompileFlags::CF_LINE_FLUSH},
+	{"-noopt", enCompileFlags::CF_NO_LOOP_OPT},
+	{"-prof", enCompileFlags::CF_PROFILE},
+	{"-proftime", enCompileFlags::CF_PROFILE_TIME},
+	{"-profview", enCompileFlags::CF_PROFILE_VIEW},
+	{"-luabc", enCompileFlags::CF_LUA_BYTECODE},
+	{"-spec", enCompileFlags::CF_SPECULATE},
+	{"-luamin", enCompileFlags::CF_LUA_MINIFY}
 };
 
 int main(int argc, char* argv[])
 try
 {
 	const char * outputName;
-	uint8_t flags = 0;
+	uint16_t flags = 0;
+	sBenchOptions bench;
+	uint32_t maxDepth = s_defaultMaxDepth;
 
 	if(argc < 2)
 		throw std::invalid_argument("No arguments passed to compiler. Ending.\n");
 
 	try
 	{
+		const auto value = [&](int& i) -> std::string
+		{
+			if(++i == argc)
+				throw std::out_of_range("Missing value");
+			return argv[i];
+		};
+
 		for(int i = 2; i < argc; i++) // Sets flags passed as argument
-			flags |= s_flags.at(std::string(argv[i]));
+		{
+			const std::string arg = argv[i];
+
+			if(arg == "-bench") // -bench N: runs the compiled program N times and reports timings
+				bench.runs = std::stoul(value(i));
+			else if(arg == "-jobs") // -jobs K: benchmark runs executed at once (0 = one per core)
+				bench.jobs = std::stoul(value(i));
+			else if(arg == "-maxdepth") // -maxdepth N: deepest nesting of blocks or parentheses accepted
+				maxDepth = std::stoul(value(i));
+			else if(arg == "-stdin") // -stdin file: input fed to every benchmark run
+			{
+				std::ifstream input(value(i), std::ios::binary);
+				if(!input)
+					throw std::invalid_argument("Cannot open input");
+				bench.input.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+			}
+			else flags |= s_flags.at(arg);
+		}
 	}
 	catch(const std::exception& e)
 	{
@@ -40,7 +76,11 @@ try
 
 	std::ifstream file(argv[1]);
 
-	compile({istreambuf_iterator<char>(file), istreambuf_iterator<char>()}, flags);
+	std::string source{istreambuf_iterator<char>(file), istreambuf_iterator<char>()};
+
+	if(flags & enCompileFlags::CF_PROFILE_VIEW)
+		printProfile(source);
+	else compile(argv[1], std::move(source), flags, bench, maxDepth);
 }
 catch(compiler_exception& e)
 {
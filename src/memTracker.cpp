@@ -0,0 +1,98 @@
+#include "memTracker.hpp"
+
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+
+using namespace Zilla::Compiler;
+
+sAllocCounters Zilla::Compiler::g_allocCounters;
+
+namespace
+{
+	// Every block carries its size and whether it was counted, so frees stay balanced when tracking is toggled
+	struct sBlockHeader
+	{
+		std::size_t size;
+		bool counted;
+	};
+
+	// Keeps the returned pointer aligned as malloc's
+	constexpr std::size_t s_headerSize = alignof(std::max_align_t);
+	static_assert(sizeof(sBlockHeader) <= s_headerSize, "Allocation header must fit in one alignment unit");
+
+	// Over-aligned blocks put the header right before the returned pointer, 'align' bytes into the block
+	std::size_t headerOffset(std::size_t align) noexcept
+	{
+		return align > s_headerSize ? align : s_headerSize;
+	}
+
+	void* allocate(std::size_t size, std::size_t align = s_headerSize) noexcept
+	{
+		const std::size_t offset = headerOffset(align);
+		void* block = align > s_headerSize
+			? std::aligned_alloc(align, (size + offset + align - 1) / align * align) // Size must be a multiple of the alignment
+			: std::malloc(size + offset);
+		if(!block) return nullptr;
+
+		auto header = reinterpret_cast<sBlockHeader*>(static_cast<char*>(block) + offset - s_headerSize);
+
+		header->size = size;
+		header->counted = g_allocCounters.enabled.load(std::memory_order_relaxed);
+
+		if(header->counted)
+		{
+			g_allocCounters.allocations.fetch_add(1, std::memory_order_relaxed);
+			g_allocCounters.bytes.fetch_add(size, std::memory_order_relaxed);
+
+			uint64_t live = g_allocCounters.liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+			uint64_t peak = g_allocCounters.peakLiveBytes.load(std::memory_order_relaxed);
+			while(live > peak && !g_allocCounters.peakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed));
+		}
+
+		return static_cast<char*>(block) + offset;
+	}
+
+	void deallocate(void* p, std::size_t align = s_headerSize) noexcept
+	{
+		if(!p) return;
+
+		auto header = reinterpret_cast<sBlockHeader*>(static_cast<char*>(p) - s_headerSize);
+		if(header->counted)
+			g_allocCounters.liveBytes.fetch_sub(header->size, std::memory_order_relaxed);
+
+		std::free(static_cast<char*>(p) - headerOffset(align));
+	}
+
+	void* allocateOrThrow(std::size_t size, std::size_t align = s_headerSize)
+	{
+		void* p = allocate(size, align);
+		if(!p) throw std::bad_alloc();
+		return p;
+	}
+}
+
+void* operator new(std::size_t size) { return allocateOrThrow(size); }
+void* operator new[](std::size_t size) { return allocateOrThrow(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+
+void operator delete(void* p) noexcept { deallocate(p); }
+void operator delete[](void* p) noexcept { deallocate(p); }
+void operator delete(void* p, std::size_t) noexcept { deallocate(p); }
+void operator delete[](void* p, std::size_t) noexcept { deallocate(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { deallocate(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { deallocate(p); }
+
+// Over-aligned types, and std::pmr::new_delete_resource, which passes the alignment for every allocation
+void* operator new(std::size_t size, std::align_val_t align) { return allocateOrThrow(size, std::size_t(align)); }
+void* operator new[](std::size_t size, std::align_val_t align) { return allocateOrThrow(size, std::size_t(align)); }
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return allocate(size, std::size_t(align)); }
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept { return allocate(size, std::size_t(align)); }
+
+void operator delete(void* p, std::align_val_t align) noexcept { deallocate(p, std::size_t(align)); }
+void operator delete[](void* p, std::align_val_t align) noexcept { deallocate(p, std::size_t(align)); }
+void operator delete(void* p, std::size_t, std::align_val_t align) noexcept { deallocate(p, std::size_t(align)); }
+void operator delete[](void* p, std::size_t, std::align_val_t align) noexcept { deallocate(p, std::size_t(align)); }
+void operator delete(void* p, std::align_val_t align, const std::nothrow_t&) noexcept { deallocate(p, std::size_t(align)); }
+void operator delete[](void* p, std::align_val_t align, const std::nothrow_t&) noexcept { deallocate(p, std::size_t(align)); }
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+
+#ifdef __linux__
+	#include <sys/resource.h>
+#elif _WIN32
+	#include <windows.h>
+	#include <psapi.h>
+#endif
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Counters fed by the global operator new/delete replacements in memTracker.cpp
+	struct sAllocCounters
+	{
+		std::atomic<bool> enabled {false};
+		std::atomic<uint64_t> allocations {0};
+		std::atomic<uint64_t> bytes {0};
+		std::atomic<uint64_t> liveBytes {0};
+		std::atomic<uint64_t> peakLiveBytes {0};
+	};
+
+	extern sAllocCounters g_allocCounters;
+
+	struct sPhaseStats
+	{
+		const char * name;
+		uint64_t allocations;
+		uint64_t bytes;
+		uint64_t peakLiveBytes;
+	};
+
+	inline static uint64_t peakRss()
+	{
+		#ifdef __linux__
+			rusage usage;
+			getrusage(RUSAGE_SELF, &usage);
+			return uint64_t(usage.ru_maxrss) * 1024; // Linux reports kilobytes
+		#elif _WIN32
+			PROCESS_MEMORY_COUNTERS counters;
+			GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+			return counters.PeakWorkingSetSize;
+		#else
+			return 0;
+		#endif
+	}
+
+	// Per-phase allocation report. Does nothing unless enabled.
+	struct sMemReport
+	{
+		sMemReport(bool enabled)
+			: enabled(enabled)
+		{
+			if(!enabled) return;
+
+			phases.reserve(8);
+			g_allocCounters.enabled = true;
+		}
+
+		~sMemReport()
+		{
+			if(enabled)
+				g_allocCounters.enabled = false;
+		}
+
+		bool enabled;
+		std::vector<sPhaseStats> phases;
+		sPhaseStats start;
+
+		void begin(const char * name)
+		{
+			if(!enabled) return;
+
+			start = {name, g_allocCounters.allocations, g_allocCounters.bytes, 0};
+			g_allocCounters.peakLiveBytes = g_allocCounters.liveBytes.load();
+		}
+
+		void end()
+		{
+			if(!enabled) return;
+
+			phases.push_back({start.name,
+				g_allocCounters.allocations - start.allocations,
+				g_allocCounters.bytes - start.bytes,
+				g_allocCounters.peakLiveBytes});
+		}
+
+		void print()
+		{
+			if(!enabled) return;
+
+			std::ofstream m_file("memory.json");
+			m_file << "{\n\t\"phases\": [\n";
+
+			for(size_t i = 0; i < phases.size(); i++)
+			{
+				auto& p = phases[i];
+				m_file << "\t\t{\"name\": \"" << p.name << "\", \"allocations\": " << p.allocations
+					<< ", \"bytes\": " << p.bytes << ", \"peakLiveBytes\": " << p.peakLiveBytes << "}"
+					<< (i + 1 < phases.size() ? ",\n" : "\n");
+
+				std::cout << p.name << ": " << p.allocations << " allocations, " << p.bytes
+					<< " bytes, " << p.peakLiveBytes << " peak live bytes\n";
+			}
+
+			m_file << "\t],\n\t\"peakRssBytes\": " << peakRss() << "\n}\n";
+			m_file.close();
+
+			std::cout << "Peak RSS: " << peakRss() << " bytes\n";
+		}
+	};
+}
+}
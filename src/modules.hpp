@@ -0,0 +1,274 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+#include <cstdint>
+#include <cstdio>
+
+#include "tokens.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Point of a generated fragment where an included module is spliced in at link time
+	struct sIncludeSite
+	{
+		size_t offset;	  // Byte offset in the including fragment's code
+		std::string path; // As written after 'inclua', relative to the including file
+	};
+
+	// Code generated from one file for one target, with its includes left unresolved
+	struct sFragment
+	{
+		std::string code;
+		std::vector<sIncludeSite> includes;
+	};
+
+	struct sModule
+	{
+		std::string path; // Normalized, relative to the working directory
+		uint64_t hash;	  // Cache key: source and code-affecting flags
+		bool cached;
+		sFragment c, lua;
+	};
+
+	using module_table = std::map<std::string, sModule>;
+
+	// What every module of a build must be compiled to
+	struct sModuleTargets
+	{
+		bool c, lua;
+		uint16_t codeFlags; // Flags that change generated code, part of the cache key
+	};
+
+	// Front end and backends of a single module. Fills the fragments asked for in the targets.
+	using module_compiler = std::function<void(const std::string& source, sModule*)>;
+
+	struct module_exception : public compiler_exception
+	{
+		module_exception(std::string path, sDiagnostic inner)
+			: path(path), inner(inner){}
+
+		std::string path;
+		sDiagnostic inner;
+
+		void print()
+		{
+			std::cout << "Module exception! " << path << ": ";
+			if(inner.line)
+				std::cout << "line " << inner.line << " column " << inner.column << ". ";
+			std::cout << inner.message << std::endl;
+		}
+
+		sDiagnostic diagnostic()
+		{
+			return {inner.kind, inner.line, inner.column, path + ": " + inner.message};
+		}
+	};
+
+	// Bump whenever generated code changes, so stale cache entries are never reused
+	inline static const char * s_moduleCacheVersion = "zc-module-3";
+	inline static const char * s_moduleCacheDir = ".zcache";
+
+	// FNV-1a, 64 bits
+	inline static uint64_t fnv1a(const std::string& data, uint64_t hash = 0xcbf29ce484222325)
+	{
+		for(unsigned char c : data)
+		{
+			hash ^= c;
+			hash *= 0x100000001b3;
+		}
+		return hash;
+	}
+
+	inline static uint64_t moduleHash(const std::string& source, uint16_t codeFlags)
+	{
+		uint64_t hash = fnv1a(s_moduleCacheVersion);
+		hash = fnv1a(std::to_string(codeFlags), hash);
+		return fnv1a(source, hash);
+	}
+
+	inline static std::string cachePath(uint64_t hash, const char * extension)
+	{
+		char name[17];
+		std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+		return std::string(s_moduleCacheDir) + "/" + name + extension;
+	}
+
+	// Cache entry layout: include count, one "offset path" line per include, then the code
+	inline static bool readFragment(const std::string& file, sFragment* fragment)
+	{
+		std::ifstream in(file, std::ios::binary);
+		size_t count;
+		if(!(in >> count))
+			return false;
+
+		fragment->includes.resize(count);
+		for(auto& site : fragment->includes)
+		{
+			in >> site.offset;
+			in.get();
+			if(!std::getline(in, site.path))
+				return false;
+		}
+
+		if(count == 0)
+			in.get();
+
+		fragment->code.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		return std::all_of(fragment->includes.begin(), fragment->includes.end(),
+			[&](const sIncludeSite& s){ return s.offset <= fragment->code.size(); });
+	}
+
+	// Written to a temporary first, so concurrent builds never read half an entry
+	inline static void writeFragment(const std::string& file, const sFragment& fragment)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(s_moduleCacheDir, error);
+
+		std::ostringstream id;
+		id << std::this_thread::get_id();
+		const std::string temporary = file + "." + id.str() + ".tmp";
+
+		std::ofstream out(temporary, std::ios::binary);
+		out << fragment.includes.size() << "\n";
+		for(auto& site : fragment.includes)
+			out << site.offset << " " << site.path << "\n";
+		out << fragment.code;
+		out.close();
+
+		if(out)
+			std::filesystem::rename(temporary, file, error);
+		if(!out || error)
+			std::filesystem::remove(temporary, error);
+	}
+
+	inline static std::string resolveInclude(const std::string& from, const std::string& path)
+	{
+		return (std::filesystem::path(from).parent_path() / path).lexically_normal().generic_string();
+	}
+
+	// Loads a module from the cache, or compiles it and stores the result
+	inline static void buildModule(sModule* module, const sModuleTargets& targets, const module_compiler& compileModule)
+	{
+		std::ifstream file(module->path, std::ios::binary);
+		if(!file)
+			throw module_exception(module->path, {"module", 0, 0, "Cannot open module"});
+
+		const std::string source{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+		module->hash = moduleHash(source, targets.codeFlags);
+
+		module->cached = (!targets.c || readFragment(cachePath(module->hash, ".c"), &module->c))
+			&& (!targets.lua || readFragment(cachePath(module->hash, ".lua"), &module->lua));
+		if(module->cached)
+			return;
+
+		try
+		{
+			compileModule(source, module);
+		}
+		catch(compiler_exception& e)
+		{
+			throw module_exception(module->path, e.diagnostic());
+		}
+
+		if(targets.c)
+			writeFragment(cachePath(module->hash, ".c"), module->c);
+		if(targets.lua)
+			writeFragment(cachePath(module->hash, ".lua"), module->lua);
+	}
+
+	// Builds every module reachable from the main file's includes. Each level of the include graph is
+	// compiled in parallel; unchanged modules come straight from the cache.
+	inline static void buildModules(const std::string& mainPath, const std::vector<sIncludeSite>& mainIncludes,
+		const sModuleTargets& targets, const module_compiler& compileModule, module_table* modules)
+	{
+		std::vector<std::string> frontier;
+		for(auto& site : mainIncludes)
+			frontier.push_back(resolveInclude(mainPath, site.path));
+
+		while(!frontier.empty())
+		{
+			std::vector<sModule*> level;
+			for(auto& path : frontier)
+				if(!modules->count(path))
+				{
+					sModule& m = (*modules)[path];
+					m.path = path;
+					level.push_back(&m);
+				}
+
+			std::vector<std::exception_ptr> errors(level.size());
+			std::atomic<size_t> next {0};
+			std::vector<std::thread> workers;
+
+			const size_t threads = std::min<size_t>(level.size(), std::max(1u, std::thread::hardware_concurrency()));
+			for(size_t t = 0; t < threads; t++)
+				workers.emplace_back([&]
+				{
+					for(size_t i; (i = next++) < level.size();)
+						try
+						{
+							buildModule(level[i], targets, compileModule);
+						}
+						catch(...)
+						{
+							errors[i] = std::current_exception();
+						}
+				});
+
+			for(auto& w : workers) w.join();
+
+			for(auto& e : errors)
+				if(e) std::rethrow_exception(e);
+
+			frontier.clear();
+			for(sModule * m : level)
+				for(auto& site : (targets.c ? m->c : m->lua).includes)
+					frontier.push_back(resolveInclude(m->path, site.path));
+		}
+	}
+
+	// Splices included modules into 'fragment', recursively. 'stack' holds the modules being expanded.
+	inline static void linkFragment(const sFragment& fragment, const std::string& path, bool lua,
+		const module_table& modules, std::vector<std::string>& stack, std::string* out)
+	{
+		size_t pos = 0;
+		for(auto& site : fragment.includes)
+		{
+			out->append(fragment.code, pos, site.offset - pos);
+			pos = site.offset;
+
+			const std::string included = resolveInclude(path, site.path);
+			if(std::find(stack.begin(), stack.end(), included) != stack.end())
+				throw module_exception(included, {"module", 0, 0, "Circular include"});
+
+			const sModule& m = modules.at(included);
+			stack.push_back(included);
+			linkFragment(lua ? m.lua : m.c, included, lua, modules, stack, out);
+			stack.pop_back();
+		}
+		out->append(fragment.code, pos, std::string::npos);
+	}
+
+	inline static std::string linkProgram(const sFragment& program, const std::string& mainPath, bool lua, const module_table& modules)
+	{
+		std::string out;
+		std::vector<std::string> stack = {std::filesystem::path(mainPath).lexically_normal().generic_string()};
+		linkFragment(program, mainPath, lua, modules, stack, &out);
+		return out;
+	}
+}
+}
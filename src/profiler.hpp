@@ -0,0 +1,190 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+
+#include "tokens.hpp"
+#include "modules.hpp"
+
+namespace Zilla
+{
+namespace Compiler
+{
+	struct sProfileSite
+	{
+		uint32_t line;
+		uint16_t column;
+	};
+
+	// Statements that get a probe in -prof builds
+	struct sProfile
+	{
+		bool timed;
+		uint64_t sourceHash; // Lets the report tell a stale profile.out from a matching one
+		std::vector<int32_t> siteOf; // Probe id of each token, or -1
+		std::vector<sProfileSite> sites;
+	};
+
+	// Probes go before assignments, reads, prints and the keyword of each if, while and do.
+	// The 'while' closing a do loop is part of it and gets none.
+	inline static sProfile findProfileSites(token_it begin, token_it end, bool timed, uint64_t sourceHash)
+	{
+		sProfile profile{timed, sourceHash, std::vector<int32_t>(end - begin, -1), {}};
+		std::vector<enToken> scopes; // Construct that opened each '{'
+		enToken lastConstruct = TK_ERROR;
+		bool closedDo = false;
+
+		for(auto it = begin; it != end; it++)
+		{
+			bool probe = false;
+			switch(it->token)
+			{
+				case TK_ID:
+					probe = it + 1 != end && (it + 1)->token == TK_OP_ASSIGN;
+					break;
+				case TK_WHILE:
+					probe = !closedDo;
+					lastConstruct = TK_WHILE;
+					break;
+				case TK_IF:
+				case TK_DO:
+					probe = true;
+					[[fallthrough]];
+				case TK_ELSE:
+					lastConstruct = it->token;
+					break;
+				case TK_READ:
+				case TK_PRINT:
+					probe = true;
+					break;
+				case TK_SCOPE_BEGIN:
+					scopes.push_back(lastConstruct);
+					break;
+				case TK_SCOPE_END:
+					closedDo = !scopes.empty() && scopes.back() == TK_DO;
+					if(!scopes.empty())
+						scopes.pop_back();
+					continue;
+				default:
+					break;
+			}
+			closedDo = false;
+
+			if(probe)
+			{
+				profile.siteOf[it - begin] = profile.sites.size();
+				profile.sites.push_back({it->line, it->column});
+			}
+		}
+
+		return profile;
+	}
+
+	// Site table and profiler settings, placed before the runtime
+	inline static void write_profile_table(std::ostream& out, const sProfile& profile, bool lua)
+	{
+		if(lua)
+		{
+			out << "local zc_prof_timed, zc_prof_source = " << (profile.timed ? "true" : "false") << ", \""
+				<< std::hex << profile.sourceHash << std::dec << "\"\nlocal zc_prof_site = {";
+			for(auto& s : profile.sites)
+				out << "{" << s.line << "," << s.column << "},";
+			out << "}\n";
+			return;
+		}
+
+		out << "#define ZC_PROFILE " << (profile.timed ? 2 : 1) << "\n#define ZC_PROFILE_SOURCE \"" << std::hex
+			<< profile.sourceHash << std::dec << "\"\n#define ZC_PROFILE_SITES " << profile.sites.size()
+			<< "\nstatic const unsigned zc_prof_site[ZC_PROFILE_SITES + 1][2] = {";
+		for(auto& s : profile.sites)
+			out << "{" << s.line << "," << s.column << "},";
+		out << "{0,0}};\n";
+	}
+
+	template<typename Out>
+	inline static void write_probe(Out& out, int32_t site, const sProfile& profile, bool lua)
+	{
+		if(!lua)
+			out << "zc_prof(" << site << ");\n";
+		else if(profile.timed)
+			out << "zc_prof(" << site + 1 << ")\n";
+		else out << "zc_pc[" << site + 1 << "] = zc_pc[" << site + 1 << "] + 1\n";
+	}
+
+	struct sLineProfile
+	{
+		uint32_t line;
+		uint64_t count, ticks;
+	};
+
+	// Renders profile.out, written by a program built with -prof, as a hottest-first listing of 'source'
+	inline static void printProfile(const std::string& source)
+	{
+		std::ifstream in("profile.out");
+		std::string magic, unit;
+		uint64_t hash;
+		if(!(in >> magic >> unit >> std::hex >> hash >> std::dec) || magic != "zcprof")
+		{
+			std::cout << "No profile found. Run a program compiled with -prof first.\n";
+			return;
+		}
+
+		if(hash != fnv1a(source))
+			std::cout << "Warning: profile.out was written by a program built from a different source.\n";
+
+		std::map<uint32_t, sLineProfile> byLine;
+		uint32_t line;
+		uint16_t column;
+		uint64_t count, ticks, totalCount = 0, totalTicks = 0;
+
+		while(in >> line >> column >> count >> ticks)
+		{
+			auto& l = byLine.emplace(line, sLineProfile{line, 0, 0}).first->second;
+			l.count += count;
+			l.ticks += ticks;
+			totalCount += count;
+			totalTicks += ticks;
+		}
+
+		std::vector<std::string> text = {""};
+		std::istringstream src(source);
+		for(std::string s; std::getline(src, s);)
+			text.push_back(s);
+
+		std::vector<sLineProfile> lines;
+		for(auto& l : byLine)
+			lines.push_back(l.second);
+
+		const bool timed = totalTicks > 0;
+		std::stable_sort(lines.begin(), lines.end(), [timed](const sLineProfile& a, const sLineProfile& b)
+		{
+			return timed ? a.ticks > b.ticks : a.count > b.count;
+		});
+
+		std::cout << std::setw(14) << "count";
+		if(timed)
+			std::cout << std::setw(16) << unit << std::setw(8) << "%";
+		std::cout << std::setw(8) << "line" << "  source\n";
+
+		for(auto& l : lines)
+		{
+			std::cout << std::setw(14) << l.count;
+			if(timed)
+				std::cout << std::setw(16) << l.ticks << std::setw(7) << std::fixed << std::setprecision(1)
+					<< 100.0 * l.ticks / totalTicks << "%";
+			std::cout << std::setw(8) << l.line << "  " << (l.line < text.size() ? text[l.line] : "") << "\n";
+		}
+
+		std::cout << "Total: " << totalCount << " statements";
+		if(timed)
+			std::cout << ", " << totalTicks << " " << unit;
+		std::cout << "\n";
+	}
+}
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+namespace Zilla
+{
+namespace Compiler
+{
+	// Runtime bundled at the top of every generated program. Output is collected in a large buffer
+	// and flushed at exit (or after every write in line-flushed mode); input is parsed straight
+	// from a large read buffer.
+
+	inline static const char * s_cRuntime = R"zc(#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#define zc_sys_read _read
+#define zc_sys_write _write
+#else
+#include <unistd.h>
+#define zc_sys_read read
+#define zc_sys_write write
+#endif
+
+#define ZC_BUFFER_SIZE (1 << 16)
+
+static char zc_out[ZC_BUFFER_SIZE];
+static size_t zc_out_len = 0;
+static char zc_in[ZC_BUFFER_SIZE];
+static size_t zc_in_pos = 0, zc_in_len = 0;
+
+static void zc_write_all(const char * s, size_t n)
+{
+	while(n > 0)
+	{
+		long done = zc_sys_write(1, s, n);
+		if(done <= 0) return;
+		s += done;
+		n -= done;
+	}
+}
+
+static void zc_flush(void)
+{
+	zc_write_all(zc_out, zc_out_len);
+	zc_out_len = 0;
+}
+
+static void zc_write(const char * s, size_t n)
+{
+	if(zc_out_len + n > ZC_BUFFER_SIZE)
+	{
+		zc_flush();
+		if(n > ZC_BUFFER_SIZE)
+		{
+			zc_write_all(s, n);
+			return;
+		}
+	}
+
+	memcpy(zc_out + zc_out_len, s, n);
+	zc_out_len += n;
+
+	if(ZC_LINE_FLUSH)
+		zc_flush();
+}
+
+#define zc_write_str(s) zc_write(s, sizeof(s) - 1)
+
+static void zc_write_int(int v)
+{
+	char buf[16];
+	char * p = buf + sizeof(buf);
+	unsigned u = v < 0 ? 0u - (unsigned)v : (unsigned)v;
+
+	*--p = '\n';
+	do
+	{
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while(u);
+
+	if(v < 0)
+		*--p = '-';
+
+	zc_write(p, buf + sizeof(buf) - p);
+}
+
+static void zc_write_double(double v)
+{
+	char buf[512];
+	int n = snprintf(buf, sizeof(buf), "%f\n", v);
+	zc_write(buf, n);
+}
+
+static int zc_getc(void)
+{
+	if(zc_in_pos == zc_in_len)
+	{
+		long n = zc_sys_read(0, zc_in, ZC_BUFFER_SIZE);
+		if(n <= 0) return -1;
+		zc_in_len = n;
+		zc_in_pos = 0;
+	}
+
+	return (unsigned char)zc_in[zc_in_pos++];
+}
+
+/* Same contract as scanf("%d"): leaves *v untouched and the offending char unread on failure */
+static void zc_read_int(int * v)
+{
+	int c = zc_getc(), neg = 0;
+	unsigned r = 0;
+
+	while(c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f')
+		c = zc_getc();
+
+	if(c == '-' || c == '+')
+	{
+		neg = c == '-';
+		c = zc_getc();
+	}
+
+	if(c < '0' || c > '9')
+	{
+		if(c >= 0) zc_in_pos--;
+		return;
+	}
+
+	for(; c >= '0' && c <= '9'; c = zc_getc())
+		r = r * 10 + (c - '0');
+
+	if(c >= 0) zc_in_pos--;
+	*v = neg ? (int)(0u - r) : (int)r;
+}
+
+#ifdef ZC_PROFILE
+/* Slot ZC_PROFILE_SITES collects whatever runs before the first probe */
+static unsigned long long zc_prof_count[ZC_PROFILE_SITES + 1], zc_prof_ticks[ZC_PROFILE_SITES + 1];
+
+#if ZC_PROFILE == 2
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define zc_ticks() __rdtsc()
+#define ZC_TICK_UNIT "cycles"
+#else
+#include <time.h>
+static unsigned long long zc_ticks(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+#define ZC_TICK_UNIT "ns"
+#endif
+
+/* Time between two probes is charged to the statement of the first one */
+static unsigned long long zc_prof_then;
+static unsigned zc_prof_last = ZC_PROFILE_SITES;
+
+#define zc_prof(k) do { \
+	unsigned long long zc_now = zc_ticks(); \
+	zc_prof_ticks[zc_prof_last] += zc_now - zc_prof_then; \
+	zc_prof_then = zc_now; \
+	zc_prof_last = (k); \
+	zc_prof_count[k]++; \
+} while(0)
+#else
+#define ZC_TICK_UNIT "none"
+#define zc_prof(k) (zc_prof_count[k]++)
+#endif
+
+static void zc_prof_write(void)
+{
+	unsigned i;
+	FILE * f;
+
+#if ZC_PROFILE == 2
+	zc_prof(ZC_PROFILE_SITES);
+#endif
+
+	f = fopen("profile.out", "w");
+	if(!f) return;
+
+	fprintf(f, "zcprof " ZC_TICK_UNIT " " ZC_PROFILE_SOURCE "\n");
+	for(i = 0; i < ZC_PROFILE_SITES; i++)
+		fprintf(f, "%u %u %llu %llu\n", zc_prof_site[i][0], zc_prof_site[i][1], zc_prof_count[i], zc_prof_ticks[i]);
+	fclose(f);
+}
+#endif
+)zc";
+
+	inline static const char * s_luaRuntime = R"zc(local zc_out, zc_n = {}, 0
+local zc_in, zc_pos = "", 1
+local zc_find, zc_sub, zc_concat, zc_write, zc_read_chunk = string.find, string.sub, table.concat, io.write, io.read
+
+local function zc_flush()
+	zc_write(zc_concat(zc_out, "", 1, zc_n))
+	zc_n = 0
+end
+
+local function zc_print(v)
+	if v == nil then v = "nil" end
+	zc_out[zc_n + 1] = v
+	zc_out[zc_n + 2] = "\n"
+	zc_n = zc_n + 2
+	if zc_line_flush or zc_n >= 8192 then zc_flush() io.flush() end
+end
+
+-- Text goes out as written, without a newline, like the C backend's zc_write_str
+local function zc_print_text(s)
+	zc_n = zc_n + 1
+	zc_out[zc_n] = s
+	if zc_line_flush or zc_n >= 8192 then zc_flush() io.flush() end
+end
+
+-- Reads the next integer, like the C backend's scanf("%d"). Returns nil on invalid input or end of input.
+local function zc_read()
+	if zc_line_flush then return io.read("n") end
+
+	while true do
+		local s, e, number = zc_find(zc_in, "^%s*([-+]?%d+)", zc_pos)
+		if s and e < #zc_in then
+			zc_pos = e + 1
+			return tonumber(number)
+		end
+
+		if not s and not zc_find(zc_in, "^%s*[-+]?$", zc_pos) then
+			return nil
+		end
+
+		local chunk = zc_read_chunk(1 << 16)
+		if not chunk then
+			if s then
+				zc_pos = e + 1
+				return tonumber(number)
+			end
+			return nil
+		end
+
+		zc_in = zc_sub(zc_in, zc_pos) .. chunk
+		zc_pos = 1
+	end
+end
+
+)zc";
+
+	// Appended to the Lua runtime in -prof builds, after the site table
+	inline static const char * s_luaProfiler = R"zc(local zc_pc, zc_pt = {}, {}
+for i = 0, #zc_prof_site do zc_pc[i], zc_pt[i] = 0, 0 end
+
+-- Time between two probes is charged to the statement of the first one. Slot 0 collects whatever runs before the first probe.
+local zc_clock = os.clock
+local zc_prof_then, zc_prof_last = zc_clock(), 0
+
+local function zc_prof(k)
+	local now = zc_clock()
+	zc_pt[zc_prof_last] = zc_pt[zc_prof_last] + (now - zc_prof_then)
+	zc_prof_then, zc_prof_last = now, k
+	zc_pc[k] = zc_pc[k] + 1
+end
+
+local function zc_prof_write()
+	if zc_prof_timed then zc_prof(0) end
+
+	local f = io.open("profile.out", "w")
+	if not f then return end
+
+	f:write("zcprof ", zc_prof_timed and "ns" or "none", " ", zc_prof_source, "\n")
+	for i, s in ipairs(zc_prof_site) do
+		f:write(s[1], " ", s[2], " ", zc_pc[i], " ", math.floor(zc_pt[i] * 1e9), "\n")
+	end
+	f:close()
+end
+
+)zc";
+}
+}
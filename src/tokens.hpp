@@ -1,12 +1,16 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <iterator>
 #include <map>
 #include <cstdint>
 #include <iostream>
 #include <initializer_list>
 #include <algorithm>
+#include <vector>
+#include <sstream>
+#include <memory_resource>
 
 namespace Zilla
 {
@@ -42,6 +46,10 @@ namespace Compiler
 		TK_PRINT,
 		TK_READ,
 		TK_DECLARE,
+		TK_INCLUDE,
+		TK_MODULE,
+		TK_MODULE_END,
+		TK_END_OF_INPUT,
 	};
 
 	inline static const std::map<enToken, const char *> s_tokenName =
@@ -73,7 +81,11 @@ namespace Compiler
 		{TK_END, "End program"},
 		{TK_PRINT, "Print"},
 		{TK_READ, "Read input"},
-		{TK_DECLARE, "Declare"}
+		{TK_DECLARE, "Declare"},
+		{TK_INCLUDE, "Include"},
+		{TK_MODULE, "Start module"},
+		{TK_MODULE_END, "End module"},
+		{TK_END_OF_INPUT, "End of input"}
 	};
 
 	inline static const char * to_name(enToken t)
@@ -81,24 +93,50 @@ namespace Compiler
 		return s_tokenName.at(t);
 	}
 
+	// Allocator-aware, so a token_vector hands its memory resource down to the lexeme text
 	struct sToken
 	{
-		sToken(enToken t, std::string::iterator begin, std::string::iterator end, uint32_t line, uint16_t column)
-			: token(t), str(begin,end + 1), line(line), column(column){}
+		using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+		sToken(enToken t, std::string::const_iterator begin, std::string::const_iterator end, uint32_t line, uint16_t column,
+			const allocator_type& alloc = {})
+			: line(line), column(column), token(t), str(begin, end + 1, alloc){}
+
+		sToken(const sToken&) = default;
+		sToken(sToken&&) = default;
+		sToken(const sToken& o, const allocator_type& alloc)
+			: line(o.line), column(o.column), token(o.token), str(o.str, alloc){}
+		sToken(sToken&& o, const allocator_type& alloc)
+			: line(o.line), column(o.column), token(o.token), str(std::move(o.str), alloc){}
+
+		sToken& operator=(const sToken&) = default;
+		sToken& operator=(sToken&&) = default;
 
 		uint32_t line;
 		uint16_t column;
 		enToken token;
-		std::string str;
+		std::pmr::string str;
+
+		std::string_view view() const { return str; }
 
 		bool operator==(enToken t) { return token == t;}
 		bool operator!=(enToken t) { return token != t;}
 		bool is_any(std::initializer_list<enToken> tl){ return std::any_of(tl.begin(), tl.end(), [this](enToken t){ return token == t;});}
 	};
 
+	// Structured form of a compiler_exception, for callers that do not print to stdout
+	struct sDiagnostic
+	{
+		const char * kind; // "lexical", "parsing", "semantic" or "module"
+		uint32_t line;	   // 0 when the diagnostic has no position
+		uint16_t column;
+		std::string message;
+	};
+
 	struct compiler_exception : public std::exception
 	{
 		virtual void print() = 0;
+		virtual sDiagnostic diagnostic() = 0;
 	};
 
 	struct lexical_exception : public compiler_exception
@@ -113,6 +151,11 @@ namespace Compiler
 		{
 			std::cout << "Lexical exception! Unrecognized token at line " << line << " column " << column << ".\n";
 		}
+
+		sDiagnostic diagnostic()
+		{
+			return {"lexical", line, column, "Unrecognized token"};
+		}
 	};
 
 	struct parsing_exception : public compiler_exception
@@ -130,6 +173,32 @@ namespace Compiler
 		{
 			std::cout << "Parsing exception! Line " << token.line << " column " << token.column << ". Expected " << expected << ", got " << to_name(token.token) << ".\n";
 		}
+
+		sDiagnostic diagnostic()
+		{
+			std::ostringstream message;
+			message << "Expected " << expected << ", got " << to_name(token.token);
+			return {"parsing", token.line, token.column, message.str()};
+		}
+	};
+
+	struct depth_exception : public compiler_exception
+	{
+		depth_exception(sToken t, uint32_t limit)
+			: token(t), limit(limit){}
+
+		sToken token;
+		uint32_t limit;
+
+		void print()
+		{
+			std::cout << "Parsing exception! Line " << token.line << " column " << token.column << ". Nesting deeper than " << limit << " levels.\n";
+		}
+
+		sDiagnostic diagnostic()
+		{
+			return {"parsing", token.line, token.column, "Nesting deeper than " + std::to_string(limit) + " levels"};
+		}
 	};
 
 	struct semantic_exception : public compiler_exception
@@ -145,6 +214,11 @@ namespace Compiler
 		{
 			std::cout << "Semantic exception! Line " << token.line << " column " << token.column << ". " << reason << std::endl;
 		}
+
+		sDiagnostic diagnostic()
+		{
+			return {"semantic", token.line, token.column, reason};
+		}
 	};
 
 	struct unused_variable_exception : public compiler_exception
@@ -158,9 +232,16 @@ namespace Compiler
 		{
 			std::cout << "Semantic exception! Unused variable: " << varName << std::endl;
 		}
+
+		sDiagnostic diagnostic()
+		{
+			return {"semantic", 0, 0, "Unused variable: " + varName};
+		}
 	};
 
-	using token_it = std::vector<sToken>::iterator;
+	// Token storage draws from the compile call's memory resource
+	using token_vector = std::pmr::vector<sToken>;
+	using token_it = token_vector::iterator;
 
 	inline static bool is_sequence(token_it& it, std::initializer_list<enToken> tokens)
 	{
@@ -176,7 +257,7 @@ namespace Compiler
 	// 	using reference = sToken&;
 	// };
 
-	inline static const std::map<const std::string, const enToken> s_reservedWords = 
+	inline static const std::map<const std::string, const enToken, std::less<>> s_reservedWords = 
 	{
 		{"if", TK_IF},
 		{"else", TK_ELSE},
@@ -187,6 +268,9 @@ namespace Compiler
 		{"escreva", TK_PRINT},
 		{"leia", TK_READ},
 		{"declare", TK_DECLARE},
+		{"inclua", TK_INCLUDE},
+		{"modulo", TK_MODULE},
+		{"fimmod", TK_MODULE_END},
 		{"ou", TK_OP_OR},
 		{"e", TK_OP_AND}
 	};
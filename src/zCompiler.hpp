@@ -10,8 +10,22 @@
 #include <fstream>
 #include <set>
 #include <string>
+#include <exception>
+#include <iterator>
+#include <sstream>
+#include <memory>
+#include <memory_resource>
 
 #include "tokens.hpp"
+#include "memTracker.hpp"
+#include "flowAnalysis.hpp"
+#include "runtime.hpp"
+#include "loopAnalysis.hpp"
+#include "modules.hpp"
+#include "profiler.hpp"
+#include "bench.hpp"
+#include "luaBytecode.hpp"
+#include "emitters.hpp"
 
 #define OUT
 
@@ -19,17 +33,25 @@ namespace Zilla
 {
 namespace Compiler
 {
-	using file_it = std::string::iterator;
+	using file_it = std::string::const_iterator;
 
 	enum enCompileFlags
 	{
 		CF_LUA_COMPILE = 0x1, // If set, compiles to Lua. Else, compiles to C.
 		CF_AUTORUN	   = 0x2, // If set, runs program after compiling.
 		CF_TOKEN_FILE  = 0x4, // If set, generates tokens.txt file detailing all tokens
+		CF_MULTI_TARGET = 0x8, // If set, compiles to both C and Lua, sharing a single front-end pass
+		CF_MEM_REPORT  = 0x10, // If set, reports allocations per compiler phase and peak RSS to memory.json
+		CF_LINE_FLUSH  = 0x20, // If set, generated programs flush output after every write (interactive use)
+		CF_NO_LOOP_OPT = 0x40, // If set, loops are emitted as written, without induction-variable rewriting
+		CF_PROFILE	   = 0x80, // If set, generated programs count executions per statement and write profile.out
+		CF_PROFILE_TIME = 0x100, // Same as CF_PROFILE, also charging elapsed time to each statement
+		CF_PROFILE_VIEW = 0x200, // If set, prints the source annotated with profile.out instead of compiling
+		CF_LUA_BYTECODE = 0x400, // If set, Lua output is written as a bytecode chunk by the compiler itself, without luac
+		CF_SPECULATE   = 0x800, // If set, code generation overlaps semantic analysis; its output is dropped on a diagnostic
+		CF_LUA_MINIFY  = 0x1000, // If set, Lua source is written without layout, with a minified runtime
 	};
 
-	uint8_t g_flags = 0;
-	
 	inline static bool is_number(const char c)
 	{
 		return c <= '9' && c >= '0';
@@ -50,14 +72,20 @@ namespace Compiler
 		return is_lowercase(c) || is_uppercase(c);
 	}
 
-	inline static void lexicalAnalysis(file_it begin, const file_it end, OUT std::vector<sToken>* tokens)
+	// Lexes [begin, end). 'begin' must be the start of a line, numbered 'firstLine'.
+	inline static void lexicalAnalysis(file_it begin, const file_it end, OUT token_vector* tokens, uint32_t firstLine = 1)
 	{
 		file_it it = begin, s_token = begin, lineBegin = begin;
-		uint32_t lineCounter = 1;
+		uint32_t lineCounter = firstLine;
 
-		const static auto createToken = [&](enToken t, char offset = 0)
+		const auto createToken = [&](enToken t, char offset = 0)
 		{ tokens->emplace_back(t, s_token, it + offset, lineCounter, s_token - lineBegin + 1); };
 
+		// Advances and returns the new character, or '\0' at the end. No lexeme goes on with '\0', so
+		// lookaheads stop there instead of reading past the buffer.
+		const auto next = [&]{ return ++it == end ? '\0' : *it; };
+		char c;
+
 	s0: // Start state
 		s_token = it;
 
@@ -106,21 +134,25 @@ namespace Compiler
 		// If fails all conditions, invalid token!
 		throw lexical_exception(lineCounter, s_token - lineBegin);
 	text:
-		switch(*++it)
+		if(++it == end) // Unterminated literal, reported where it starts
+			throw lexical_exception(lineCounter, s_token - lineBegin);
+		switch(*it)
 		{
 			case '"':
 				createToken(TK_TEXT); ++it; goto s0;
 			case '\\':
-				++it; [[fallthrough]];
+				if(++it == end)
+					throw lexical_exception(lineCounter, s_token - lineBegin);
+				[[fallthrough]];
 			default:
 				goto text;
 		}
 	zero:
-		if(*(it + 1) == 'x') // Hexadecimal prefix (0x)
+		if(it + 1 != end && *(it + 1) == 'x') // Hexadecimal prefix (0x)
 			++it;
 	number:
-		if(is_number(*++it)) goto number;
-		switch(*it)
+		if(is_number(c = next())) goto number;
+		switch(c)
 		{
 			case 'f':
 				createToken(TK_FLOAT, -1); ++it; goto s0;
@@ -130,8 +162,8 @@ namespace Compiler
 				createToken(TK_INT, -1); goto s0;
 		}
 	fnum: // Floating point
-		if(is_number(*++it)) goto fnum;
-		switch(*it)
+		if(is_number(c = next())) goto fnum;
+		switch(c)
 		{
 			case 'f': // If has suffix f, float. Else, double.
 				createToken(TK_FLOAT, -1); ++it; goto s0;
@@ -140,19 +172,19 @@ namespace Compiler
 		}
 	id:
 		{
-			if(is_letter(*++it) || is_number(*it))
+			if(is_letter(c = next()) || is_number(c))
 				goto id;
 
 			createToken(TK_ID, -1);
 		
-			auto find = s_reservedWords.find(tokens->back().str);
+			auto find = s_reservedWords.find(tokens->back().view());
 			if(find != s_reservedWords.cend())
 				tokens->back().token = find->second;
 
 			goto s0;
 		}
 	op_rel:
-		switch(*++it)
+		switch(next())
 		{
 			case '=':
 				++it; [[fallthrough]];
@@ -160,7 +192,7 @@ namespace Compiler
 				createToken(TK_OP_REL, -1); goto s0;
 		}
 	op_assign:
-		switch(*++it)
+		switch(next())
 		{
 			case '=':
 				++it;
@@ -169,24 +201,154 @@ namespace Compiler
 				throw lexical_exception(lineCounter, s_token - lineBegin);
 		}
 	excl_mark:
-		switch(*++it)
+		switch(next())
 		{
 			case '=':
 				++it;
-				createToken(TK_OP_REL); goto s0;
+				createToken(TK_OP_REL, -1); goto s0;
 			default:
 				createToken(TK_NEGATION, -1); goto s0;
 		}
 	}
 
-	inline static void parse_expr(token_it&);
-	inline static void parse_factor(token_it&);
-	inline static void parse_term(token_it&);
-	inline static void parse_cmd(token_it&);
-	inline static void parse_cmdif(token_it&);
-	inline static void parse_cmdwhile(token_it&);
-	inline static void parse_cmddo(token_it&);
-	inline static void parse_logicexpr(token_it&);
+	// Sources smaller than this are lexed on the calling thread
+	inline static constexpr size_t s_minLexChunk = 1 << 20;
+
+	// Summary of a chunk for both possible start states (0 = code, 1 = inside a text literal)
+	struct sChunkSummary
+	{
+		bool endsInText[2];
+		uint32_t lines[2]; // Newlines seen outside text literals, as the lexer counts them
+	};
+
+	// Mirrors the lexer's text state: '"' opens and closes a literal, '\\' escapes the next char
+	inline static void scanTextState(file_it it, const file_it end, bool inText, OUT bool* endsInText, OUT uint32_t* lines)
+	{
+		uint32_t lineCounter = 0;
+
+		for(; it != end; ++it)
+			if(inText)
+			{
+				if(*it == '\\')
+				{
+					if(++it == end) break;
+				}
+				else if(*it == '"')
+					inText = false;
+			}
+			else if(*it == '"')
+				inText = true;
+			else if(*it == '\n')
+				lineCounter++;
+
+		*endsInText = inText;
+		*lines = lineCounter;
+	}
+
+	// Sources run 2.3 to 3 bytes per token, so a vector sized from this rarely has to grow
+	inline static constexpr size_t s_sourceBytesPerToken = 2;
+
+	// Same output as lexicalAnalysis, but splits the source at newlines and lexes the chunks in parallel.
+	inline static void parallelLexicalAnalysis(file_it begin, const file_it end, OUT token_vector* tokens)
+	{
+		const size_t size = end - begin;
+		const size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+		if(threads == 1 || size < 2 * s_minLexChunk)
+			return lexicalAnalysis(begin, end, tokens);
+
+		// Tentative chunk boundaries, each one just after a newline
+		const size_t chunkSize = std::max(s_minLexChunk, size / threads);
+		std::vector<file_it> bounds = {begin};
+
+		while(size_t(end - bounds.back()) > chunkSize)
+		{
+			auto nl = std::find(bounds.back() + chunkSize, end, '\n');
+			if(nl == end || nl + 1 == end)
+				break;
+			bounds.push_back(nl + 1);
+		}
+		bounds.push_back(end);
+
+		const size_t chunks = bounds.size() - 1;
+		std::vector<sChunkSummary> summaries(chunks);
+		std::vector<std::thread> workers;
+
+		// Speculative pass: summarizes every chunk for both start states
+		for(size_t i = 0; i < chunks; i++)
+			workers.emplace_back([&, i]
+			{
+				for(int state = 0; state < 2; state++)
+					scanTextState(bounds[i], bounds[i + 1], state, &summaries[i].endsInText[state], &summaries[i].lines[state]);
+			});
+
+		for(auto& w : workers) w.join();
+		workers.clear();
+
+		// Fix-up: resolves the real start state of each chunk. Boundaries inside text literals are dropped.
+		std::vector<file_it> starts = {begin};
+		std::vector<uint32_t> firstLines = {1};
+		bool inText = false;
+		uint32_t lineCounter = 1;
+
+		for(size_t i = 0; i < chunks; i++)
+		{
+			if(i > 0 && !inText)
+			{
+				starts.push_back(bounds[i]);
+				firstLines.push_back(lineCounter);
+			}
+
+			lineCounter += summaries[i].lines[inText];
+			inText = summaries[i].endsInText[inText];
+		}
+		starts.push_back(end);
+
+		// The first part goes straight into 'tokens' on this thread. The others run on the default resource,
+		// since the caller's one need not be thread-safe, and each is freed as soon as it is merged.
+		const size_t parts = firstLines.size();
+		std::vector<token_vector> partTokens(parts);
+		std::vector<std::exception_ptr> errors(parts);
+
+		const auto lexPart = [&](size_t i, token_vector* out)
+		{
+			try
+			{
+				lexicalAnalysis(starts[i], starts[i + 1], out, firstLines[i]);
+			}
+			catch(...)
+			{
+				errors[i] = std::current_exception();
+			}
+		};
+
+		for(size_t i = 1; i < parts; i++)
+			workers.emplace_back(lexPart, i, &partTokens[i]);
+
+		lexPart(0, tokens);
+		for(auto& w : workers) w.join();
+
+		// The first failing chunk holds the error the sequential lexer would have hit
+		for(auto& e : errors)
+			if(e) std::rethrow_exception(e);
+
+		size_t total = tokens->size();
+		for(auto& part : partTokens)
+			total += part.size();
+
+		tokens->reserve(total);
+		for(auto& part : partTokens)
+		{
+			std::move(part.begin(), part.end(), std::back_inserter(*tokens));
+			token_vector().swap(part);
+		}
+	}
+
+	// Deepest nesting of blocks, or of parentheses within one expression, accepted by default
+	inline static constexpr uint32_t s_defaultMaxDepth = 1u << 24;
+
+	// Text of the end-of-input token the parser appends while it runs
+	inline static const std::string s_endOfInput = " ";
 
 	// Declare ->  declare id( ',' id)* '.'
 	inline static void parse_declare(token_it& it)
@@ -207,6 +369,52 @@ namespace Compiler
 		}
 	}
 
+	// Expr -> Term ((+ | -) Term)*
+	// Term -> Factor (('*' | '/') Factor)*
+	// Factor -> id | int | float | double | '('Expr')'
+	// Parentheses are the only nesting inside an expression, so a counter stands in for recursion.
+	// Leaves 'it' on the last token of the expression.
+	inline static void parse_expr(token_it& it, uint32_t maxDepth)
+	{
+		uint32_t depth = 0;
+		while(true)
+		{
+			for(; *it == TK_PARENTH_BEGIN; ++it) // (
+				if(++depth > maxDepth)
+					throw depth_exception(*it, maxDepth);
+
+			if(!it->is_any({TK_ID, TK_INT, TK_FLOAT, TK_DOUBLE})) // id | int | float | double
+				throw parsing_exception(*it, "Factor");
+
+			for(; depth && *(it + 1) == TK_PARENTH_END; ++it) // )
+				depth--;
+
+			if(!(it + 1)->is_any({TK_OP_ADDSUB, TK_OP_MULTDIV})) // (+ | - | * | /)
+				break;
+			it += 2;
+		}
+
+		if(depth)
+			throw parsing_exception(*(it + 1), TK_PARENTH_END);
+	}
+
+	// Logicterm -> Expr (< | > | <= | >= | != | == ) Expr
+	inline static void parse_logicterm(token_it& it, uint32_t maxDepth)
+	{
+		parse_expr(it, maxDepth); // Expr
+		if(*(it + 1) != TK_OP_REL) // (< | > | <= | >= | != | == )
+			throw parsing_exception(*(it+1), TK_OP_REL);
+		parse_expr(it+=2, maxDepth); // Expr
+	}
+
+	// Logicexpr -> Logicterm ((e | ou) Logicterm)*
+	inline static void parse_logicexpr(token_it& it, uint32_t maxDepth)
+	{
+		parse_logicterm(it, maxDepth); // Logicterm
+		while((it + 1)->is_any({TK_OP_OR, TK_OP_AND})) // (e|ou)
+			parse_logicterm(it+=2, maxDepth); // Logicterms
+	}
+
 	// Cmdread -> leia '(' id ')' '.'
 	inline static void parse_cmdread(token_it& it)
 	{
@@ -246,7 +454,7 @@ namespace Compiler
 	}
 
 	// Cmdexpr -> id ':=' Expr '.'
-	inline static void parse_cmdexpr(token_it& it)
+	inline static void parse_cmdexpr(token_it& it, uint32_t maxDepth)
 	{
 		if(*it != TK_ID) // id
 			throw parsing_exception(*it, TK_ID);
@@ -254,490 +462,554 @@ namespace Compiler
 		if(*(++it) != TK_OP_ASSIGN) // :=
 			throw parsing_exception(*it, TK_OP_ASSIGN);
 
-		parse_expr(++it); // Expr
+		parse_expr(++it, maxDepth); // Expr
 
 		if(*(++it) != TK_COMMAND_END) // .
 			throw parsing_exception(*it, TK_COMMAND_END);
 	}
 
-	// Cmd -> Cmdread | Cmdprint | Cmdexpr | Cmdif | Cmdwhile | Cmddo
-	inline static void parse_cmd(token_it& it)
+	// Cmdinclude -> inclua text '.'
+	inline static void parse_cmdinclude(token_it& it)
 	{
-		auto start = it;
-		try
-		{
-			parse_cmdread(it); // Cmdread
-			return;
-		}
-		catch(parsing_exception& e){ }
-
-		try
-		{
-			parse_cmdprint(it = start); // Cmdprint
-			return;
-		}
-		catch(parsing_exception& e){ }
-
-		try
-		{
-			parse_cmdexpr(it = start); // Cmdexpr
-			return;
-		}
-		catch(parsing_exception& e){ }
+		if(*it != TK_INCLUDE) // inclua
+			throw parsing_exception(*it, TK_INCLUDE);
 
-		try
-		{
-			parse_cmdif(it = start); // Cmdif
-			return;
-		}
-		catch(parsing_exception& e){  }
+		if(*(++it) != TK_TEXT) // text
+			throw parsing_exception(*it, TK_TEXT);
 
-		try
-		{
-			parse_cmdwhile(it = start); // Cmdwhile
-			return;
-		}
-		catch(parsing_exception& e){ }
-
-		try
-		{
-			parse_cmddo(it = start); // Cmddo
-			return;
-		}
-		catch(parsing_exception& e){ }
-		
-		throw parsing_exception(*it, "Command");
+		if(*(++it) != TK_COMMAND_END) // .
+			throw parsing_exception(*it, TK_COMMAND_END);
 	}
 
-	// Cmdif -> if '(' Logicexpr ')' '{' Cmd* '}' (else '{' Cmd* '}')?
-	inline static void parse_cmdif(token_it& it)
+	// '(' Logicexpr ')' '{' after 'if' or 'while'. Leaves 'it' on the '{'.
+	inline static void parse_condition(token_it& it, uint32_t maxDepth)
 	{
-		if(*it != TK_IF) // if
-			throw parsing_exception(*it, TK_IF);
-		
 		if(*(++it) != TK_PARENTH_BEGIN) // (
 			throw parsing_exception(*it, TK_PARENTH_BEGIN);
-				
-		parse_logicexpr(++it); // Logicexpr
+
+		parse_logicexpr(++it, maxDepth); // Logicexpr
 
 		if(*(++it) != TK_PARENTH_END) // )
 			throw parsing_exception(*it, TK_PARENTH_END);
-		
-		if(*(++it) != TK_SCOPE_BEGIN) //{
-			throw parsing_exception(*it, TK_SCOPE_BEGIN);
 
-		try
-		{
-			auto start = it;
-			while(true)
-			{
-				parse_cmd(++start); // Cmd*
-				it = start;
-			}
-		}catch(parsing_exception& e){ }
-
-		if(*(++it) != TK_SCOPE_END) // }
-			throw parsing_exception(*it, TK_SCOPE_END);
-		
-		if(*(it + 1) != TK_ELSE) // else
-			return;
-		
-		if(*(it+=2) != TK_SCOPE_BEGIN) // {
+		if(*(++it) != TK_SCOPE_BEGIN) // {
 			throw parsing_exception(*it, TK_SCOPE_BEGIN);
-
-		try
-		{
-			auto start = it;
-			while(true)
-			{
-				parse_cmd(++start); // Cmd*
-				it = start;
-			}
-		}catch(parsing_exception& e){ }
-
-		if(*(++it) != TK_SCOPE_END) // }
-			throw parsing_exception(*it, TK_SCOPE_END);
 	}
 
-	// Cmdexpr -> while'(' Logicexpr ')' '{' Cmd* '}'
-	inline static void parse_cmdwhile(token_it& it)
+	// Cmd -> Cmdread | Cmdprint | Cmdexpr | Cmdif | Cmdwhile | Cmddo | Cmdinclude
+	// Cmdif -> if '(' Logicexpr ')' '{' Cmd* '}' (else '{' Cmd* '}')?
+	// Cmdwhile -> while '(' Logicexpr ')' '{' Cmd* '}'
+	// Cmddo -> do '{' Cmd* '}' while '(' Logicexpr ')' '.'
+	// Parses Cmd* up to 'end', leaving 'it' on it. The first token of a command picks its rule, so nothing
+	// is retried; blocks still open are kept on a heap stack instead of the call stack.
+	inline static void parse_cmds(token_it& it, enToken end, uint32_t maxDepth)
 	{
-		if(*it != TK_WHILE) // while
-			throw parsing_exception(*it, TK_WHILE);
-
-		if(*(++it) != TK_PARENTH_BEGIN) // (
-			throw parsing_exception(*it, TK_PARENTH_BEGIN);
-
-		parse_logicexpr(++it); // Logicexpr
-		
-		if(*(++it) != TK_PARENTH_END) // )
-			throw parsing_exception(*it, TK_PARENTH_END);
+		std::vector<enToken> open; // Construct of each '{' not closed yet
 
-		if(*(++it) != TK_SCOPE_BEGIN) //{
-			throw parsing_exception(*it, TK_SCOPE_BEGIN);
+		const auto enter = [&](enToken construct)
+		{
+			if(open.size() == maxDepth)
+				throw depth_exception(*it, maxDepth);
+			open.push_back(construct);
+		};
 
-		try
+		for(;; ++it)
 		{
-			auto start = it;
-			while(true)
+			switch(it->token)
 			{
-				parse_cmd(++start); // Cmd*
-				it = start;
+				case TK_READ:
+					parse_cmdread(it); // Cmdread
+					break;
+				case TK_PRINT:
+					parse_cmdprint(it); // Cmdprint
+					break;
+				case TK_ID:
+					parse_cmdexpr(it, maxDepth); // Cmdexpr
+					break;
+				case TK_INCLUDE:
+					parse_cmdinclude(it); // Cmdinclude
+					break;
+				case TK_IF:
+				case TK_WHILE:
+					enter(it->token);
+					parse_condition(it, maxDepth); // '(' Logicexpr ')' '{'
+					break;
+				case TK_DO:
+					enter(TK_DO);
+					if(*(++it) != TK_SCOPE_BEGIN) // {
+						throw parsing_exception(*it, TK_SCOPE_BEGIN);
+					break;
+				case TK_SCOPE_END: // }
+				{
+					if(open.empty())
+						throw parsing_exception(*it, end);
+
+					const enToken construct = open.back();
+					open.pop_back();
+
+					if(construct == TK_IF && *(it + 1) == TK_ELSE) // else '{'
+					{
+						if(*(it += 2) != TK_SCOPE_BEGIN)
+							throw parsing_exception(*it, TK_SCOPE_BEGIN);
+						open.push_back(TK_ELSE);
+					}
+					else if(construct == TK_DO)
+					{
+						if(*(++it) != TK_WHILE) // while
+							throw parsing_exception(*it, TK_WHILE);
+
+						if(*(++it) != TK_PARENTH_BEGIN) // (
+							throw parsing_exception(*it, TK_PARENTH_BEGIN);
+
+						parse_logicexpr(++it, maxDepth); // Logicexpr
+
+						if(*(++it) != TK_PARENTH_END) // )
+							throw parsing_exception(*it, TK_PARENTH_END);
+
+						if(*(++it) != TK_COMMAND_END) // .
+							throw parsing_exception(*it, TK_COMMAND_END);
+					}
+					break;
+				}
+				default:
+					if(open.empty() && *it == end)
+						return;
+					throw open.empty() ? parsing_exception(*it, "Command") : parsing_exception(*it, TK_SCOPE_END);
 			}
-		}catch(parsing_exception& e){ }
-
-		if(*(++it) != TK_SCOPE_END) // }
-			throw parsing_exception(*it, TK_SCOPE_END);
+		}
 	}
 
-	// Cmdexpr -> do '{' Cmd* '}' while'(' Logicexpr ')'.
-	inline static void parse_cmddo(token_it& it)
+	// Program -> programa Declare (Cmd)* fimprog '.'
+	inline static void parse_program(token_it it, uint32_t maxDepth)
 	{
-		if(*it != TK_DO) // do
-			throw parsing_exception(*it, TK_DO);
-
-		if(*(++it) != TK_SCOPE_BEGIN) //{
-			throw parsing_exception(*it, TK_SCOPE_BEGIN);
-
-		try
-		{
-			auto start = it;
-			while(true)
-			{
-				parse_cmd(++start); // Cmd*
-				it = start;
-			}
-		}catch(parsing_exception& e){ }
+		if(*it != TK_INIT) // programa
+			throw parsing_exception(*it, TK_INIT);
 		
+		parse_declare(++it); // Declare
 
-		if(*(++it) != TK_SCOPE_END) // }
-			throw parsing_exception(*it, TK_SCOPE_END);
+		parse_cmds(++it, TK_END, maxDepth); // (Cmd)* fimprog
 
-		if(*(++it) != TK_WHILE) // while
-			throw parsing_exception(*it, TK_WHILE);
+		if(*(++it) != TK_COMMAND_END) // .
+			throw parsing_exception(*it, TK_COMMAND_END);
+	}
 
-		if(*(++it) != TK_PARENTH_BEGIN) // (
-			throw parsing_exception(*it, TK_PARENTH_BEGIN);
+	// Module -> modulo Declare? (Cmd)* fimmod '.'
+	inline static void parse_module(token_it it, uint32_t maxDepth)
+	{
+		if(*it != TK_MODULE) // modulo
+			throw parsing_exception(*it, TK_MODULE);
 
-		parse_logicexpr(++it); // Logicexpr
-		
-		if(*(++it) != TK_PARENTH_END) // )
-			throw parsing_exception(*it, TK_PARENTH_END);
+		if(*(it + 1) == TK_DECLARE)
+			parse_declare(++it); // Declare
+
+		parse_cmds(++it, TK_MODULE_END, maxDepth); // (Cmd)* fimmod
 
 		if(*(++it) != TK_COMMAND_END) // .
 			throw parsing_exception(*it, TK_COMMAND_END);
 	}
 
-	// Logicterm -> Expr (< | > | <= | >= | != | == ) Expr
-	inline static void parse_logicterm(token_it& it)
+	// A file is either a program or a module meant to be included by one. Runs in time and memory linear
+	// in the token count. An end-of-input token is appended while parsing, so a truncated file fails on it
+	// instead of reading past the tokens.
+	inline static void parser(token_vector& tokens, uint32_t maxDepth = s_defaultMaxDepth)
 	{
-		parse_expr(it); // Expr
-		if(*(it + 1) != TK_OP_REL) // (< | > | <= | >= | != | == )
-			throw parsing_exception(*(it+1), TK_OP_REL);
-		parse_expr(it+=2); // Expr
-	}
+		const uint32_t line = tokens.empty() ? 1 : tokens.back().line;
+		tokens.emplace_back(TK_END_OF_INPUT, s_endOfInput.cbegin(), s_endOfInput.cbegin(), line, 0);
 
-	// Logicexpr -> Logicterm ((e | ou) Logicterm)*
-	inline static void parse_logicexpr(token_it& it)
-	{
-		parse_logicterm(it); // Logicterm
-		while((it + 1)->is_any({TK_OP_OR, TK_OP_AND})) // (e|ou)
-			parse_logicterm(it+=2); // Logicterms
+		try
+		{
+			if(tokens.front() == TK_MODULE)
+				parse_module(tokens.begin(), maxDepth);
+			else parse_program(tokens.begin(), maxDepth);
+		}
+		catch(compiler_exception&)
+		{
+			tokens.pop_back();
+			throw;
+		}
+		tokens.pop_back();
 	}
 
-	// Expr -> Term ((+ | -) Term)*
-	inline static void parse_expr(token_it& it)
+	inline static void output_c(const std::string& code)
 	{
-		parse_term(it);	// Term
-		while(*(it + 1) == TK_OP_ADDSUB) // (+ | -)
-			parse_term(it+=2); // Term
+		std::ofstream f_out("output.c", std::ios::out);
+		f_out << code;
+		f_out.close();
+
+		#ifdef __linux__
+			system("gcc output.c -o output");
+		#elif _WIN32
+			system("gcc output.c -o output.exe");
+		#endif
 	}
 
-	// Program -> programa Declare (Cmd)* fimprog '.'
-	inline static void parse_program(token_it it)
+	inline static void run_c()
 	{
-		if(*it != TK_INIT) // programa
-			throw parsing_exception(*it, TK_INIT);
-		
-		parse_declare(++it); // Declare
-
-		while(*(++it) != TK_END) // fimprog
-			parse_cmd(it); // Cmd
-
-		if(*(++it) != TK_COMMAND_END) // .
-			throw parsing_exception(*it, TK_COMMAND_END);
+		#ifdef __linux__
+			system("./output");
+		#elif _WIN32
+			system("./output.exe");
+		#endif
 	}
 
-	// Factor -> id | int | float | double | '('Expr')'
-	inline static void parse_factor(token_it& it)
+	// Writes the bytecode chunk when there is one; otherwise the source, compiled by luac
+	inline static void output_lua(const std::string& code, const std::string& chunk)
 	{
-		switch(it->token)
+		if(!chunk.empty())
 		{
-			case enToken::TK_ID: // id
-			case enToken::TK_INT: // int
-			case enToken::TK_FLOAT: // float
-			case enToken::TK_DOUBLE: // double
-				return;
-			case enToken::TK_PARENTH_BEGIN: // (
-				parse_expr(++it); // Expr
-				if((++it)->token == TK_PARENTH_END) // )
-					throw parsing_exception(*it, TK_PARENTH_END);
-				break;
-			default:
-				throw parsing_exception(*it, "Factor");
+			std::ofstream c_out("luac.out", std::ios::out | std::ios::binary);
+			c_out << chunk;
+			return;
 		}
+
+		std::ofstream f_out("output.lua", std::ios::out);
+		f_out << code;
+		f_out.close();
+
+		system("luac output.lua");
 	}
 
-	// Term -> Factor (('*' | '/') Factor)*
-	inline static void parse_term(token_it& it)
+	inline static void run_lua()
 	{
-		parse_factor(it); // Factor
-		while(*(it + 1) == TK_OP_MULTDIV) // '*' | '/'
-			parse_factor(it+=2); // Factor
+		system("lua luac.out");
 	}
-
-	inline static void parser(std::vector<sToken>& tokens)
+	
+	// Builds and solves the program's CFG. Throws on undeclared identifiers.
+	inline static sFlowGraph buildSemanticGraph(const token_vector& tokens)
 	{
-		parse_program(tokens.begin());
+		sFlowGraph flow;
+		buildFlowGraph(tokens, &flow);
+		solveFlowGraph(flow);
+		return flow;
 	}
 
-	inline static void output_c(token_it begin, token_it end)
+	// Definite-assignment and unused-variable checks over a solved CFG. Only reads 'flow'.
+	inline static void checkSemantics(const token_vector& tokens, const sFlowGraph& flow)
 	{
-		std::ofstream f_out("output.c", std::ios::out);
+		// Replays each block from its definitely-assigned entry set, keeping the earliest offending use
+		const sUse * unassigned = nullptr;
+		std::vector<bool> used(flow.variables.size(), false);
 
-		for(auto it = begin; it != end; it++)
-			switch(it->token)
+		for(auto& b : flow.blocks)
+		{
+			sBitset assigned = b.assignedIn;
+			for(auto& st : b.statements)
 			{
-			case enToken::TK_INIT:
-				f_out << "#include <stdio.h>\n\nint main()\n{\n"; break;
-			case TK_END:
-				f_out << "\nreturn 0;\n}";
-				it++;
-				break;
-			case enToken::TK_PRINT:
-				f_out << "printf(";
-				it+=2;
-				switch(it->token)
+				for(auto& u : st.uses)
 				{
-					case TK_TEXT:
-						f_out << it->str; break;
-					case TK_INT:
-					case TK_ID:
-						f_out << "\"%d\\n\"," << it->str; break;
-					case TK_FLOAT:
-						f_out << "\"%f\\n\"," << it->str; break;
-					case TK_DOUBLE:
-						f_out << "\"%lf\\n\","<< it->str; break;
+					used[u.var] = true;
+					if(!assigned.test(u.var) && (!unassigned || u.token < unassigned->token))
+						unassigned = &u;
 				}
-				break;
-			case TK_READ:
-				f_out << "scanf(\"\%d\", &";
-				it+=2;
-				f_out << it->str;
-				break;
-			case TK_DECLARE:
-				f_out << "int "; break;
-			case TK_COMMAND_END:
-				f_out << ";\n"; break;
-			case TK_OP_ASSIGN:
-				f_out << " = "; break;
-			case TK_SCOPE_BEGIN:
-				f_out << "\n{\n\t"; break;
-			case TK_SCOPE_END:
-				f_out << "}\n"; break;
-			case TK_OP_ADDSUB:
-			case TK_OP_MULTDIV:
-			case TK_OP_REL:
-				f_out << " " << it->str << " "; break;
-			case TK_TEXT:
-			case TK_INT:
-			case TK_FLOAT:
-			case TK_DOUBLE:
-			case TK_PARENTH_BEGIN:
-			case TK_PARENTH_END:
-			case TK_IF:
-			case TK_ELSE:
-			case TK_COMMA:
-			case TK_ID:
-			case TK_DO:
-			case TK_WHILE:
-				f_out << it->str; break;
+
+				if(st.def >= 0)
+					assigned.set(st.def);
 			}
-		
-		f_out.close();
+		}
 
-		#ifdef __linux__
-			system("gcc output.c -o output");
-			if(g_flags & CF_AUTORUN)
-				system("./output");
-		#elif _WIN32
-			system("gcc output.c -o output.exe");
-			if(g_flags & CF_AUTORUN)
-				system("./output.exe");
-		#endif
+		if(unassigned)
+			throw semantic_exception(tokens[unassigned->token], "Unassigned identifier!");
+
+		for(size_t i = 0; i < used.size(); i++)
+			if(!used[i])
+				throw unused_variable_exception(flow.variables[i]);
 	}
 
-	inline static void output_lua(token_it begin, token_it end)
+	// Definite-assignment and unused-variable checks over the program's CFG. Returns the solved graph,
+	// whose liveness facts are available to the backends.
+	inline static sFlowGraph semanticalAnalysis(const token_vector& tokens)
 	{
-		std::ofstream f_out("output.lua", std::ios::out);
-		enToken lastCondition;
+		sFlowGraph flow = buildSemanticGraph(tokens);
+		checkSemantics(tokens, flow);
+		return flow;
+	}
 
-		for(auto it = begin; it != end; it++)
-			switch(it->token)
-			{
-			case TK_INIT:
-			case TK_END:
-				break;
-			case TK_DECLARE:
-				while((++it)->token != TK_COMMAND_END);
-				break;
-			case TK_PRINT:
-				f_out << "print";
-				break;
-			case TK_READ:
-				f_out << (it+=2)->str << " = io.read()";
-				++it;
-				break;
-			case TK_COMMAND_END:
-				f_out << "\n"; break;
-			case TK_OP_ASSIGN:
-				f_out << " = "; break;
-			case TK_SCOPE_BEGIN:
-				switch(lastCondition)
-				{
-					case TK_IF:
-						f_out << "\nthen\n\t"; break;
-					case TK_WHILE:
-						f_out << "\ndo\n\t"; break;
-					case TK_ELSE:
-					case TK_DO:
-						break;
-				}
-				break;
-				
-			case TK_SCOPE_END:
-				switch(lastCondition)
-				{
-					case TK_IF:
-						if((it + 1)->token == TK_ELSE)
-							break;
-						[[fallthrough]];
-					case TK_WHILE:
-					case TK_ELSE:
-						f_out << "end\n";
-						break;
-					case TK_DO:
-						++it;
-						f_out << "until ";
-						break;
-				}
-				break;
-			case TK_OP_ADDSUB:
-			case TK_OP_MULTDIV:
-			case TK_OP_REL:
-				f_out << " " << it->str << " "; break;
-			case TK_ELSE:
-				lastCondition = TK_ELSE;
-				f_out << "else\n\t";
-				break;
-			case TK_WHILE:
-				lastCondition = TK_WHILE;
-				f_out << "while ";
-				break;
-			case TK_DO:
-				lastCondition = TK_DO;
-				f_out << "repeat\n\t";
-				break;
-			case TK_IF:
-				lastCondition = TK_IF;
-				[[fallthrough]];
-			case TK_TEXT:
-			case TK_INT:
-			case TK_FLOAT:
-			case TK_DOUBLE:
-			case TK_PARENTH_BEGIN:
-			case TK_PARENTH_END:
-			case TK_COMMA:
-			case TK_ID:
-				f_out << it->str; break;
-			}
-		
-		f_out.close();
+	inline static void emit_tokens(token_it begin, token_it end, std::ostream& t_file)
+	{
+		std::for_each(begin, end, [&](const sToken& t)
+		{
+			t_file << "\'" << t.str << "\'(" <<  to_name(t.token) << "): line " << t.line << " column " << t.column << std::endl;
+		});
+	}
 
-		system("luac output.lua");
-		if(g_flags & CF_AUTORUN)
-			system("lua luac.out");
+	inline static void generateTokenFile(const std::string& tokenList)
+	{
+		std::ofstream t_file("tokens.txt");
+		t_file << tokenList;
+		t_file.close();
 	}
-	
-	inline static void semanticalAnalysis(token_it begin, token_it end)
+
+	struct sCompileOptions
 	{
-		std::set<std::string> declaredIds, assignedIds, unusedIds;
+		uint16_t flags = 0; // enCompileFlags. CF_AUTORUN and CF_MEM_REPORT only matter to the command line driver.
+		std::pmr::memory_resource * resource = nullptr; // Allocator context of the tokens and their text. If null, the call gets its own pool.
+		uint32_t maxDepth = s_defaultMaxDepth; // Deepest nesting the parser accepts
+	};
 
-		for(auto it = begin; it != end; it++)
-			switch(it->token)
+	// Everything a compile call produces. Owns the call's pool when no resource was given: unlike a monotonic
+	// arena, it hands the token vector's outgrown buffers back.
+	struct sCompileResult
+	{
+		sCompileResult(std::pmr::memory_resource * resource = nullptr)
+			: arena(resource ? nullptr : new std::pmr::unsynchronized_pool_resource()),
+			  tokens(resource ? resource : arena.get()){}
+
+		std::unique_ptr<std::pmr::unsynchronized_pool_resource> arena;
+		token_vector tokens;
+		std::string c, lua, tokenList;
+		std::string luaChunk; // Lua 5.4 bytecode. When set, 'lua' is left empty.
+		std::vector<sIncludeSite> cIncludes, luaIncludes; // Modules still to be spliced into c and lua
+		std::vector<sDiagnostic> diagnostics;
+
+		bool success() const { return diagnostics.empty(); }
+	};
+
+	// Runs 'background' on its own thread alongside 'foreground'. Both always finish before an exception from
+	// either one, foreground first, is rethrown, so the thread is never left joinable.
+	inline static void runBoth(const std::function<void()>& background, const std::function<void()>& foreground)
+	{
+		std::exception_ptr backgroundError, foregroundError;
+		std::thread thread([&]
+		{
+			try { background(); }
+			catch(...) { backgroundError = std::current_exception(); }
+		});
+
+		try { foreground(); }
+		catch(...) { foregroundError = std::current_exception(); }
+		thread.join();
+
+		if(foregroundError || backgroundError)
+			std::rethrow_exception(foregroundError ? foregroundError : backgroundError);
+	}
+
+	// Phase report that records nothing
+	struct sNoPhaseReport
+	{
+		void begin(const char *){}
+		void end(){}
+	};
+
+	// Runs the whole pipeline without touching global state, stdout or the filesystem.
+	// Throws compiler_exception on the first diagnostic.
+	template<typename PhaseReport>
+	inline static void compileToMemory(const std::string& source, uint16_t flags, OUT sCompileResult* result, PhaseReport& report,
+		uint32_t maxDepth = s_defaultMaxDepth)
+	{
+		token_vector& tokens = result->tokens;
+
+		report.begin("lexical");
+		tokens.reserve(source.size() / s_sourceBytesPerToken);
+		parallelLexicalAnalysis(source.cbegin(), source.cend(), OUT &tokens);
+		report.end();
+
+		if(flags & (uint16_t)CF_TOKEN_FILE)
+		{
+			report.begin("tokenFile");
+			std::ostringstream t_out;
+			emit_tokens(tokens.begin(), tokens.end(), t_out);
+			result->tokenList = t_out.str();
+			report.end();
+		}
+
+		report.begin("parser");
+		parser(tokens, maxDepth);
+		report.end();
+
+		sLoopPlan loopPlan;
+		const sLoopPlan * plan = flags & (uint16_t)CF_NO_LOOP_OPT ? nullptr : &loopPlan;
+
+		sProfile profileSites;
+		if(flags & (uint16_t)(CF_PROFILE | CF_PROFILE_TIME))
+			profileSites = findProfileSites(tokens.begin(), tokens.end(), flags & (uint16_t)CF_PROFILE_TIME, fnv1a(source));
+		const sProfile * profile = flags & (uint16_t)(CF_PROFILE | CF_PROFILE_TIME) ? &profileSites : nullptr;
+
+		const auto generate_c = [&]
+		{
+			std::ostringstream f_out;
+			emit_target<sCTarget>(tokens.begin(), tokens.end(), f_out, flags & (uint16_t)CF_LINE_FLUSH, plan, profile, &result->cIncludes);
+			result->c = f_out.str();
+		};
+
+		const auto generate_lua = [&]
+		{
+			if(flags & (uint16_t)CF_LUA_BYTECODE && !profile)
+				result->luaChunk = emit_lua_bytecode(tokens, flags & (uint16_t)CF_LINE_FLUSH);
+			if(!result->luaChunk.empty())
+				return;
+
+			std::ostringstream f_out;
+			if(flags & (uint16_t)CF_LUA_MINIFY)
+				emit_target<sMinLuaTarget>(tokens.begin(), tokens.end(), f_out, flags & (uint16_t)CF_LINE_FLUSH, plan, profile, &result->luaIncludes);
+			else emit_target<sLuaTarget>(tokens.begin(), tokens.end(), f_out, flags & (uint16_t)CF_LINE_FLUSH, plan, profile, &result->luaIncludes);
+			result->lua = f_out.str();
+		};
+
+		const auto generate = [&]
+		{
+			if(flags & (uint16_t)CF_MULTI_TARGET) // Both backends share the read-only tokens
+				runBoth(generate_lua, generate_c);
+			else if(flags & (uint16_t)CF_LUA_COMPILE)
+				generate_lua();
+			else generate_c();
+		};
+
+		if(!(flags & (uint16_t)CF_SPECULATE))
+		{
+			report.begin("semantic");
+			sFlowGraph flow = semanticalAnalysis(tokens);
+			report.end();
+
+			report.begin("loops");
+			if(plan)
+				loopPlan = analyzeLoops(tokens, &flow);
+			report.end();
+
+			report.begin("codegen");
+			generate();
+			report.end();
+			return;
+		}
+
+		// Code generation runs before the semantic checks have passed; on a diagnostic its output is dropped.
+		// Phases overlap, so their allocations are reported together.
+		report.begin("speculative");
+		std::exception_ptr diagnostic, failure;
+
+		const auto overlap = [&](const std::function<void()>& check, const std::function<void()>& work)
+		{
+			std::thread checker([&]
 			{
-				case TK_DECLARE: // Sets all declared ids as declared
-					while(*(++it) != TK_COMMAND_END)
-						if(*it == TK_ID)
-							declaredIds.emplace(it->str);
-					break;
-				case TK_OP_ASSIGN: // Sets all assigned ids as assigned
-					assignedIds.emplace((it - 1)->str);
-					break;
-				case TK_READ: // Sets read ids as assigned
-					assignedIds.emplace((it + 2)->str);
-					break;
-				case TK_ID: 
-
-					if(*(it + 1) == TK_OP_ASSIGN) // If id will be assigned, ignores
-						break;
-						
-					if(declaredIds.find(it->str) == declaredIds.end()) // If id is undeclared, error
-						throw semantic_exception(*it, "Undeclared identifier!");
-					
-					if(assignedIds.find(it->str) == assignedIds.end()) // If id is unassigned, error
-						throw semantic_exception(*it, "Unassigned identifier!");
-
-					unusedIds.erase(it->str); // Sets id as used
-					break;
+				try { check(); }
+				catch(...) { diagnostic = std::current_exception(); }
+			});
+
+			try { work(); }
+			catch(...) { failure = std::current_exception(); }
+			checker.join();
+		};
+
+		if(!plan) // Backends need nothing from the semantic pass: all of it runs alongside them
+			overlap([&]{ semanticalAnalysis(tokens); }, generate);
+		else // The loop plan reads only liveness: the definite-assignment solve and the checks run alongside it and codegen
+		{
+			sFlowGraph flow;
+			buildFlowGraph(tokens, &flow);
+			initFlowFacts(flow);
+			solveLiveness(flow);
 
-				case TK_PRINT: // Sets printed ids as used
-					unusedIds.erase((it + 2)->str);
-					break;
-			};
+			overlap([&]{ solveAssignment(flow); checkSemantics(tokens, flow); }, [&]
+			{
+				loopPlan = analyzeLoops(tokens, &flow);
+				generate();
+			});
+		}
+		report.end();
 
-		
-		for(auto str : unusedIds)
-			throw unused_variable_exception(str);
+		if(diagnostic || failure)
+		{
+			result->c.clear();
+			result->lua.clear();
+			result->luaChunk.clear();
+			result->cIncludes.clear();
+			result->luaIncludes.clear();
+			std::rethrow_exception(diagnostic ? diagnostic : failure);
+		}
 	}
 
-	inline static void generateTokenFile(token_it begin, token_it end)
+	// Builds the modules included by the program at 'path', then splices them into its generated code
+	inline static void linkModules(const std::string& path, uint16_t flags, OUT sCompileResult* result, uint32_t maxDepth = s_defaultMaxDepth)
 	{
-		std::ofstream t_file("tokens.txt");
-		std::for_each(begin, end, [&](sToken t)
+		const sModuleTargets targets =
 		{
-			t_file << "\'" << t.str << "\'(" <<  to_name(t.token) << "): line " << t.line << " column " << t.column << std::endl;
-		});
+			!(flags & (uint16_t)CF_LUA_COMPILE) || flags & (uint16_t)CF_MULTI_TARGET,
+			flags & (uint16_t)(CF_LUA_COMPILE | CF_MULTI_TARGET) ? true : false,
+			uint16_t(flags & (uint16_t)(CF_NO_LOOP_OPT | CF_LUA_MINIFY)) // Cache entries are per target, other flags only touch the program's prologue
+		};
 
-		t_file.close();
+		// Every module goes through the same pipeline as a program, on its own
+		const module_compiler compileModule = [&](const std::string& source, sModule* module)
+		{
+			sCompileResult moduleResult;
+			sNoPhaseReport report;
+			compileToMemory(source, flags & ~(uint16_t)(CF_TOKEN_FILE | CF_PROFILE | CF_PROFILE_TIME), &moduleResult, report, maxDepth);
+
+			if(moduleResult.tokens.front() != TK_MODULE)
+				throw parsing_exception(moduleResult.tokens.front(), TK_MODULE);
+
+			module->c = {std::move(moduleResult.c), std::move(moduleResult.cIncludes)};
+			module->lua = {std::move(moduleResult.lua), std::move(moduleResult.luaIncludes)};
+		};
+
+		module_table modules;
+		buildModules(path, targets.c ? result->cIncludes : result->luaIncludes, targets, compileModule, &modules);
+
+		if(targets.c)
+			result->c = linkProgram({std::move(result->c), std::move(result->cIncludes)}, path, false, modules);
+		if(targets.lua)
+			result->lua = linkProgram({std::move(result->lua), std::move(result->luaIncludes)}, path, true, modules);
 	}
 
-	inline static void compile(std::string file, uint8_t flags)
+	inline static void compile(const std::string& path, std::string file, uint16_t flags, const sBenchOptions& bench = {},
+		uint32_t maxDepth = s_defaultMaxDepth)
 	{
-		g_flags = flags;
-		
-		std::vector<sToken> tokens;
-		lexicalAnalysis(file.begin(), file.end(), OUT &tokens);
+		sMemReport memReport(flags & (uint16_t)CF_MEM_REPORT);
+		sCompileResult result;
 
-		if(flags & (uint8_t)CF_TOKEN_FILE)
-			generateTokenFile(tokens.begin(), tokens.end());
+		try
+		{
+			compileToMemory(file, flags, OUT &result, memReport, maxDepth);
+
+			memReport.begin("modules");
+			linkModules(path, flags, OUT &result, maxDepth);
+			memReport.end();
+		}
+		catch(compiler_exception&)
+		{
+			if(!result.tokenList.empty()) // Tokens are listed even when a later phase fails
+				generateTokenFile(result.tokenList);
+			throw;
+		}
+
+		if(flags & (uint16_t)CF_TOKEN_FILE)
+			generateTokenFile(result.tokenList);
+
+		if(flags & (uint16_t)CF_MULTI_TARGET)
+			runBoth([&]{ output_lua(result.lua, result.luaChunk); }, [&]{ output_c(result.c); });
+		else if(flags & (uint16_t)CF_LUA_COMPILE)
+			output_lua(result.lua, result.luaChunk);
+		else output_c(result.c);
+
+		memReport.print();
+
+		if(bench.runs)
+		{
+			#ifdef __linux__
+				const std::vector<std::string> c = {"./output"};
+			#elif _WIN32
+				const std::vector<std::string> c = {"./output.exe"};
+			#endif
+
+			std::string luaOutput, cOutput;
+			if(flags & (uint16_t)(CF_MULTI_TARGET | CF_LUA_COMPILE))
+				luaOutput = benchmark("Lua", {"lua", "luac.out"}, bench);
+			if(!(flags & (uint16_t)CF_LUA_COMPILE))
+				cOutput = benchmark("C", c, bench);
+
+			if(flags & (uint16_t)CF_MULTI_TARGET)
+				std::cout << "C and Lua outputs " << (cOutput == luaOutput ? "match" : "differ") << "\n";
+		}
+
+		if(!(flags & (uint16_t)CF_AUTORUN)) // Programs run one after another, so their stdio never interleaves
+			return;
 
-		parser(tokens);
-		semanticalAnalysis(tokens.begin(), tokens.end());
+		if(flags & (uint16_t)(CF_MULTI_TARGET | CF_LUA_COMPILE))
+			run_lua();
+		if(!(flags & (uint16_t)CF_LUA_COMPILE))
+			run_c();
 
-		if(flags & (uint8_t)CF_LUA_COMPILE)
-			output_lua(tokens.begin(), tokens.end());
-		else output_c(tokens.begin(), tokens.end());
+		if(flags & (uint16_t)(CF_PROFILE | CF_PROFILE_TIME))
+			printProfile(file);
 	}
 }
 }
\ No newline at end of file
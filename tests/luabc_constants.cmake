@@ -0,0 +1,28 @@
+# Prints more distinct text literals than LOADK can index (2^17) through -lua -luabc and checks every one
+# comes back. Run with -DZC=<zCompiler> -DLUA=<lua>.
+file(WRITE constants.isi "programa\ndeclare a.\na := 1.\nescreva(a).\n")
+set(expected "1\n")
+
+# 140 pieces of 1000 literals: appending each literal to one growing string is quadratic
+foreach(piece RANGE 0 139)
+	set(source "")
+	set(text "")
+	foreach(i RANGE 1 1000)
+		string(APPEND source "escreva(\"s${piece}_${i} \").\n")
+		string(APPEND text "s${piece}_${i} ")
+	endforeach()
+	file(APPEND constants.isi "${source}")
+	string(APPEND expected "${text}")
+endforeach()
+file(APPEND constants.isi "fimprog.\n")
+
+file(REMOVE luac.out)
+execute_process(COMMAND ${ZC} constants.isi -lua -luabc OUTPUT_QUIET)
+if(NOT EXISTS luac.out)
+	message(FATAL_ERROR "-luabc wrote no chunk")
+endif()
+
+execute_process(COMMAND ${LUA} luac.out OUTPUT_VARIABLE output RESULT_VARIABLE result)
+if(NOT result EQUAL 0 OR NOT output STREQUAL expected)
+	message(FATAL_ERROR "Constants past LOADK's reach printed wrong")
+endif()